@@ -0,0 +1,104 @@
+#!/bin/sh
+#
+# TCP throughput through the "fw" namespace for proxied and plain
+# connections, with GRO and TSO on and off on the veth pairs.
+#
+# Proxied connections take the path of synproxy.rules, with a MARK rule
+# standing in for DPI: every packet to the iperf3 port is classified as
+# application 11 and allowed. Plain connections are accepted by conntrack
+# only. Large GSO packets are forwarded as such between veths, so with
+# offloads on the sequence and timestamp translation sees super-packets.
+#
+# Needs root, iperf3, jq, ethtool, ipt_SYNPROXY.ko loaded and libxt_spstate
+# installed.
+#
+# usage: gro_throughput.sh
+
+DURATION=${DURATION:-10}
+PORT=5201
+
+ns_fw="ip netns exec fw"
+
+setup()
+{
+	ip netns add cli
+	ip netns add fw
+	ip netns add srv
+
+	ip link add c0 netns cli type veth peer name f0 netns fw
+	ip link add s0 netns srv type veth peer name f1 netns fw
+
+	ip -n cli addr add 10.0.1.2/24 dev c0
+	ip -n fw addr add 10.0.1.1/24 dev f0
+	ip -n fw addr add 10.0.2.1/24 dev f1
+	ip -n srv addr add 10.0.2.2/24 dev s0
+
+	for l in "cli c0" "fw f0" "fw f1" "srv s0" "cli lo" "fw lo" "srv lo"; do
+		ip -n ${l% *} link set ${l#* } up
+	done
+
+	ip -n cli route add default via 10.0.1.1
+	ip -n srv route add default via 10.0.2.1
+	$ns_fw sysctl -qw net.ipv4.ip_forward=1
+
+	ip netns exec srv iperf3 -s -D -p $PORT
+	sleep 1
+}
+
+cleanup()
+{
+	ip netns pids srv | xargs -r kill
+	ip netns del cli 2>/dev/null
+	ip netns del fw 2>/dev/null
+	ip netns del srv 2>/dev/null
+}
+
+# offload on|off
+offload()
+{
+	for l in "cli c0" "fw f0" "fw f1" "srv s0"; do
+		ip netns exec ${l% *} ethtool -K ${l#* } gro $1 tso $1 gso $1 \
+			>/dev/null 2>&1
+	done
+}
+
+# rules proxied|plain
+rules()
+{
+	{
+		echo "*mangle"
+		echo "-A FORWARD -p tcp --dport $PORT -j MARK --set-mark 0xb"
+		echo "COMMIT"
+		echo "*filter"
+		echo ":FORWARD DROP"
+		if [ "$1" = proxied ]; then
+			echo "-A FORWARD -m conntrack --ctstate RELATED,ESTABLISHED -m spstate ! --in-progress -j ACCEPT"
+			echo "-A FORWARD -p tcp --dport $PORT -m spstate --in-progress -m mark --mark 0xb -j SYNPROXY --sack-perm --timestamp --wscale 7 --mss 1460"
+			echo "-A FORWARD -p tcp --dport $PORT -m spstate --none -j SYNPROXY --sack-perm --timestamp --wscale 7 --mss 1460"
+		else
+			echo "-A FORWARD -m conntrack --ctstate NEW,RELATED,ESTABLISHED -j ACCEPT"
+		fi
+		echo "COMMIT"
+	} | $ns_fw iptables-restore
+}
+
+# Received Mbit/s at the server.
+run()
+{
+	ip netns exec cli iperf3 -c 10.0.2.2 -p $PORT -t $DURATION -J |
+		jq ".end.sum_received.bits_per_second / 1000000 | floor"
+}
+
+trap cleanup EXIT INT TERM
+cleanup
+setup
+
+printf "offload\tplain Mbit/s\tproxied Mbit/s\n"
+for o in on off; do
+	offload $o
+	rules plain
+	plain=$(run)
+	rules proxied
+	proxied=$(run)
+	printf "%s\t%s\t%s\n" $o $plain $proxied
+done
@@ -0,0 +1,89 @@
+#!/bin/sh
+#
+# Packets per second one DPI worker forwards, reading the queue the way the
+# daemon used to (full copy, one message per recv, one verdict per packet)
+# and with a copy range, recvmmsg and batched verdicts.
+#
+# UDP datagrams of LEN bytes are forwarded by the "fw" namespace between
+# "cli" and "srv" through queue 0, whose worker runs on CPU 0.
+#
+# Needs root, iperf3, jq and the nfq binary built from examle/nfq.c.
+#
+# usage: nfq_pps.sh [len...]
+
+LENS=${*:-"64 512 1400"}
+DURATION=${DURATION:-10}
+NFQ=${NFQ:-$(dirname $0)/../examle/nfq}
+
+ns_fw="ip netns exec fw"
+
+setup()
+{
+	ip netns add cli
+	ip netns add fw
+	ip netns add srv
+
+	ip link add c0 netns cli type veth peer name f0 netns fw
+	ip link add s0 netns srv type veth peer name f1 netns fw
+
+	ip -n cli addr add 10.0.1.2/24 dev c0
+	ip -n fw addr add 10.0.1.1/24 dev f0
+	ip -n fw addr add 10.0.2.1/24 dev f1
+	ip -n srv addr add 10.0.2.2/24 dev s0
+
+	for l in "cli c0" "fw f0" "fw f1" "srv s0" "cli lo" "fw lo" "srv lo"; do
+		ip -n ${l% *} link set ${l#* } up
+	done
+
+	ip -n cli route add default via 10.0.1.1
+	ip -n srv route add default via 10.0.2.1
+	$ns_fw sysctl -qw net.ipv4.ip_forward=1
+
+	{
+		echo "*mangle"
+		echo "-A FORWARD -j NFQUEUE --queue-num 0"
+		echo "COMMIT"
+	} | $ns_fw iptables-restore
+
+	ip netns exec srv iperf3 -s -D
+	sleep 1
+}
+
+cleanup()
+{
+	pkill -f "^$NFQ" 2>/dev/null
+	ip netns pids srv | xargs -r kill
+	ip netns del cli 2>/dev/null
+	ip netns del fw 2>/dev/null
+	ip netns del srv 2>/dev/null
+}
+
+# Received packets per second at the server.
+run()
+{
+	ip netns exec cli iperf3 -c 10.0.2.2 -u -b 0 -l $1 -t $DURATION -J |
+		jq ".end.sum | (.packets - .lost_packets) / $DURATION | floor"
+}
+
+# pps <len> <nfq options>
+pps()
+{
+	len=$1
+	shift
+	$ns_fw $NFQ "$@" &
+	sleep 1
+	run $len
+	pkill -f "^$NFQ"
+	wait
+}
+
+trap cleanup EXIT INT TERM
+cleanup
+setup
+
+printf "len\tbefore pps\tafter pps\n"
+for len in $LENS; do
+	before=$(pps $len -m 1 -b 1 -c 0xffff -g)
+	after=$(pps $len)
+	printf "%s\t%s\t%s\n" $len $before $after
+done
@@ -0,0 +1,100 @@
+#!/bin/sh
+#
+# Forwarding rate through the DPI daemon as the number of queues grows.
+#
+# Every forwarded packet is queued, spread over the queues by the CPU that
+# forwards it (--queue-cpu-fanout). One iperf3 client per queue is pinned to
+# its own CPU, so its packets are forwarded and queued there. The filter
+# table accepts everything, only the cost of the queue round trip is
+# measured.
+#
+# Needs root, iperf3, jq and the nfq binary built from examle/nfq.c.
+#
+# usage: nfq_scaling.sh [queues...]
+
+QUEUES=${*:-"1 2 4 8"}
+DURATION=${DURATION:-10}
+NFQ=${NFQ:-$(dirname $0)/../examle/nfq}
+PORT=5201
+
+ns_fw="ip netns exec fw"
+
+setup()
+{
+	ip netns add cli
+	ip netns add fw
+	ip netns add srv
+
+	ip link add c0 netns cli type veth peer name f0 netns fw
+	ip link add s0 netns srv type veth peer name f1 netns fw
+
+	ip -n cli addr add 10.0.1.2/24 dev c0
+	ip -n fw addr add 10.0.1.1/24 dev f0
+	ip -n fw addr add 10.0.2.1/24 dev f1
+	ip -n srv addr add 10.0.2.2/24 dev s0
+
+	for l in "cli c0" "fw f0" "fw f1" "srv s0" "cli lo" "fw lo" "srv lo"; do
+		ip -n ${l% *} link set ${l#* } up
+	done
+
+	ip -n cli route add default via 10.0.1.1
+	ip -n srv route add default via 10.0.2.1
+	$ns_fw sysctl -qw net.ipv4.ip_forward=1
+}
+
+cleanup()
+{
+	pkill -f "^$NFQ" 2>/dev/null
+	ip netns pids srv | xargs -r kill
+	ip netns del cli 2>/dev/null
+	ip netns del fw 2>/dev/null
+	ip netns del srv 2>/dev/null
+}
+
+# rules <queues>
+rules()
+{
+	{
+		echo "*mangle"
+		echo "-A FORWARD -j NFQUEUE --queue-balance 0:$(($1 - 1)) --queue-cpu-fanout"
+		echo "COMMIT"
+	} | $ns_fw iptables-restore
+}
+
+# Received Mbit/s at the servers, one client per queue.
+run()
+{
+	i=0
+	while [ $i -lt $1 ]; do
+		ip netns exec srv iperf3 -s -1 -D -p $((PORT + i))
+		i=$((i + 1))
+	done
+	sleep 1
+
+	i=0
+	while [ $i -lt $1 ]; do
+		ip netns exec cli taskset -c $i \
+			iperf3 -c 10.0.2.2 -p $((PORT + i)) -t $DURATION -J \
+			> /tmp/nfq_scaling.$i &
+		i=$((i + 1))
+	done
+	wait
+
+	cat /tmp/nfq_scaling.* |
+		jq -s "map(.end.sum_received.bits_per_second) | add / 1000000 | floor"
+	rm -f /tmp/nfq_scaling.*
+}
+
+trap cleanup EXIT INT TERM
+cleanup
+setup
+
+printf "queues\tMbit/s\n"
+for n in $QUEUES; do
+	rules $n
+	$ns_fw $NFQ -n $n &
+	sleep 1
+	printf "%s\t%s\n" $n $(run $n)
+	pkill -f "^$NFQ"
+	wait
+done
@@ -0,0 +1,136 @@
+/*
+ * Scan throughput of the signature matcher as the number of signatures
+ * grows, for each kernel the CPU supports.
+ *
+ * Signatures are random strings of 4 to 16 printable bytes, one in ten is
+ * anchored. The corpus is made of 1024 byte payloads, half random binary
+ * data and half text resembling HTTP requests, so that the prefilter sees
+ * both rare and frequent candidate bytes. No signature is planted, every
+ * payload is scanned to its end.
+ *
+ * build: gcc -O2 -o sig_bench bench/sig_bench.c examle/sig.c -Iexamle
+ * usage: sig_bench [signatures...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sig.h"
+
+#define PAYLOADS	4096
+#define PAYLOAD_LEN	1024
+#define ROUNDS		20
+
+static const char *const words[] = {
+	"GET ", "POST ", "/index.html", " HTTP/1.1\r\n", "Host: ",
+	"User-Agent: ", "Accept: */*\r\n", "Cookie: ", "example.com",
+	"Content-Length: ", "\r\n\r\n",
+};
+
+static void fill_payload(uint8_t *p, int text)
+{
+	size_t i = 0, n;
+	const char *w;
+
+	if (!text) {
+		for (i = 0; i < PAYLOAD_LEN; i++)
+			p[i] = rand();
+		return;
+	}
+
+	while (i < PAYLOAD_LEN) {
+		w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+		n = strlen(w);
+		if (n > PAYLOAD_LEN - i)
+			n = PAYLOAD_LEN - i;
+		memcpy(p + i, w, n);
+		i += n;
+	}
+}
+
+static struct sig_matcher *build(unsigned int count)
+{
+	struct sig_matcher *m;
+	struct sig_set *set;
+	uint8_t pat[16];
+	unsigned int i, j, len;
+
+	set = sig_set_new();
+	for (i = 0; i < count; i++) {
+		len = 4 + rand() % 13;
+		for (j = 0; j < len; j++)
+			pat[j] = 0x21 + rand() % 94;
+		sig_set_add(set, pat, len, rand() % 10 ? 0 : SIG_F_ANCHORED,
+			    1 + i % 255);
+	}
+
+	m = sig_compile(set);
+	sig_set_free(set);
+	return m;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* MB/s, or 0 if the kernel is not supported */
+static double run(struct sig_matcher *m, enum sig_kernel kernel,
+		  const uint8_t *corpus)
+{
+	volatile uint32_t sink = 0;
+	double start;
+	int r, i;
+
+	if (sig_set_kernel(m, kernel) < 0)
+		return 0;
+
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < PAYLOADS; i++)
+			sink += sig_match(m, corpus + (size_t)i * PAYLOAD_LEN,
+					  PAYLOAD_LEN);
+	}
+
+	return (double)ROUNDS * PAYLOADS * PAYLOAD_LEN / (now() - start) / 1e6;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int def[] = { 10, 100, 1000, 5000, 20000 };
+	struct sig_matcher *m;
+	uint8_t *corpus;
+	unsigned int count;
+	int i, n;
+
+	srand(1);
+	corpus = malloc((size_t)PAYLOADS * PAYLOAD_LEN);
+	if (!corpus)
+		return 1;
+	for (i = 0; i < PAYLOADS; i++)
+		fill_payload(corpus + (size_t)i * PAYLOAD_LEN, i & 1);
+
+	n = argc > 1 ? argc - 1 : (int)(sizeof(def) / sizeof(def[0]));
+	printf("sigs\tstates\tscalar MB/s\tsse4.2 MB/s\tavx2 MB/s\n");
+	for (i = 0; i < n; i++) {
+		count = argc > 1 ? strtoul(argv[i + 1], NULL, 0) : def[i];
+		m = build(count);
+		if (!m) {
+			fprintf(stderr, "can't compile %u signatures\n", count);
+			return 1;
+		}
+
+		printf("%u\t%u\t%.0f\t%.0f\t%.0f\n", count, sig_states(m),
+		       run(m, SIG_KERNEL_SCALAR, corpus),
+		       run(m, SIG_KERNEL_SSE42, corpus),
+		       run(m, SIG_KERNEL_AVX2, corpus));
+		sig_free(m);
+	}
+
+	free(corpus);
+	return 0;
+}
@@ -0,0 +1,213 @@
+/*
+ * Startup and reload cost of the signature matcher: loading and compiling
+ * a signature file against mapping its compiled image, and how long a
+ * swapped out image stays in use while a worker scans packets.
+ *
+ * Signatures are random strings of 4 to 16 printable bytes as in
+ * sig_bench.c, written to a file in the current directory together with
+ * their image. The worker thread scans batches of 32 payloads of 1024
+ * bytes and announces the matcher it uses per batch, as nfq does. A reload
+ * maps the image again, swaps it in and waits until the worker has left
+ * the old one; the median of 20 reloads is shown.
+ *
+ * build: gcc -O2 -o sig_image_bench bench/sig_image_bench.c examle/sig.c -Iexamle -lpthread
+ * usage: sig_image_bench [signatures...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "sig.h"
+
+#define SIG_FILE	"sig_image_bench.sigs"
+#define IMAGE_FILE	"sig_image_bench.img"
+#define PAYLOADS	1024
+#define PAYLOAD_LEN	1024
+#define BATCH		32
+#define RELOADS		20
+
+static struct sig_matcher *matcher;
+static struct sig_matcher *in_use;
+static uint8_t *corpus;
+static int stop;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int write_sigs(unsigned int count)
+{
+	unsigned int i, j, len;
+	FILE *f;
+
+	f = fopen(SIG_FILE, "w");
+	if (!f)
+		return -1;
+	for (i = 0; i < count; i++) {
+		fprintf(f, "%u %s", 1 + i % 255, rand() % 10 ? "" : "^");
+		len = 4 + rand() % 13;
+		for (j = 0; j < len; j++)
+			fprintf(f, "\\x%02x", 0x21 + rand() % 94);
+		fputc('\n', f);
+	}
+	return fclose(f);
+}
+
+static struct sig_matcher *compile_file(void)
+{
+	struct sig_matcher *m;
+	struct sig_set *set;
+
+	set = sig_set_new();
+	if (!set || sig_set_load(set, SIG_FILE) < 0)
+		return NULL;
+	m = sig_compile(set);
+	sig_set_free(set);
+	return m;
+}
+
+static void *worker(void *arg)
+{
+	volatile uint32_t sink = 0;
+	struct sig_matcher *m;
+	unsigned int i = 0, j;
+
+	(void)arg;
+	while (!__atomic_load_n(&stop, __ATOMIC_RELAXED)) {
+		do {
+			m = __atomic_load_n(&matcher, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&in_use, m, __ATOMIC_SEQ_CST);
+		} while (m != __atomic_load_n(&matcher, __ATOMIC_SEQ_CST));
+
+		for (j = 0; j < BATCH; j++, i = (i + 1) % PAYLOADS)
+			sink += sig_match(m, corpus + (size_t)i * PAYLOAD_LEN,
+					  PAYLOAD_LEN);
+
+		__atomic_store_n(&in_use, NULL, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Median ms to map the image, and until the old one is released */
+static int reloads(double *map_ms, double *release_ms)
+{
+	double map[RELOADS], release[RELOADS], start, swapped;
+	struct sig_matcher *m, *old;
+	pthread_t thread;
+	int i;
+
+	matcher = sig_map_image(IMAGE_FILE);
+	if (!matcher)
+		return -1;
+	stop = 0;
+	if (pthread_create(&thread, NULL, worker, NULL))
+		return -1;
+
+	for (i = 0; i < RELOADS; i++) {
+		usleep(10000);
+		start = now();
+		m = sig_map_image(IMAGE_FILE);
+		if (!m)
+			break;
+		old = __atomic_exchange_n(&matcher, m, __ATOMIC_SEQ_CST);
+		swapped = now();
+		while (__atomic_load_n(&in_use, __ATOMIC_SEQ_CST) == old)
+			sched_yield();
+		release[i] = (now() - swapped) * 1e3;
+		map[i] = (swapped - start) * 1e3;
+		sig_free(old);
+	}
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+	pthread_join(thread, NULL);
+	sig_free(matcher);
+	if (i < RELOADS)
+		return -1;
+
+	qsort(map, RELOADS, sizeof(map[0]), cmp);
+	qsort(release, RELOADS, sizeof(release[0]), cmp);
+	*map_ms = map[RELOADS / 2];
+	*release_ms = release[RELOADS / 2];
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int def[] = { 100, 1000, 10000, 50000 };
+	double start, compile_ms, write_ms, map_ms, reload_ms, release_ms;
+	struct sig_matcher *m;
+	unsigned int count;
+	size_t i;
+	int n, k;
+
+	srand(1);
+	corpus = malloc((size_t)PAYLOADS * PAYLOAD_LEN);
+	if (!corpus)
+		return 1;
+	for (i = 0; i < (size_t)PAYLOADS * PAYLOAD_LEN; i++)
+		corpus[i] = rand();
+
+	n = argc > 1 ? argc - 1 : (int)(sizeof(def) / sizeof(def[0]));
+	printf("sigs\tstates\tcompile ms\twrite ms\tmap ms\treload ms\trelease ms\n");
+	for (k = 0; k < n; k++) {
+		count = argc > 1 ? strtoul(argv[k + 1], NULL, 0) : def[k];
+		if (write_sigs(count) < 0) {
+			fprintf(stderr, "can't write %s\n", SIG_FILE);
+			return 1;
+		}
+
+		start = now();
+		m = compile_file();
+		compile_ms = (now() - start) * 1e3;
+		if (!m) {
+			fprintf(stderr, "can't compile %u signatures\n", count);
+			return 1;
+		}
+
+		start = now();
+		if (sig_write_image(m, count, IMAGE_FILE) < 0) {
+			fprintf(stderr, "can't write %s\n", IMAGE_FILE);
+			return 1;
+		}
+		write_ms = (now() - start) * 1e3;
+		sig_free(m);
+
+		start = now();
+		m = sig_map_image(IMAGE_FILE);
+		map_ms = (now() - start) * 1e3;
+		if (!m) {
+			fprintf(stderr, "can't map %s\n", IMAGE_FILE);
+			return 1;
+		}
+
+		if (reloads(&reload_ms, &release_ms) < 0) {
+			fprintf(stderr, "can't reload %s\n", IMAGE_FILE);
+			return 1;
+		}
+
+		printf("%u\t%u\t%.1f\t%.1f\t%.2f\t%.2f\t%.3f\n", count,
+		       sig_states(m), compile_ms, write_ms, map_ms, reload_ms,
+		       release_ms);
+		sig_free(m);
+	}
+
+	unlink(SIG_FILE);
+	unlink(IMAGE_FILE);
+	free(corpus);
+	return 0;
+}
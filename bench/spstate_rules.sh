@@ -0,0 +1,98 @@
+#!/bin/sh
+#
+# Per-packet cost of the DPI policy as the number of allowed applications
+# grows: one spstate rule per application (revision 0 layout) against a
+# single rule with --l7-marks (revision 1).
+#
+# Traffic is forwarded by the "fw" namespace between "cli" and "srv" and
+# marked with the last application, which is the worst case for the per
+# application layout. Forwarded flows are never proxied, so their state is
+# --none, the rules differ from the DPI rules only in the state they check.
+#
+# Needs root, iperf3, jq, ipt_SYNPROXY.ko loaded and libxt_spstate
+# installed. L7 marks are limited to 255.
+#
+# usage: spstate_rules.sh [apps...]
+
+APPS=${*:-"1 10 50 100 255"}
+DURATION=${DURATION:-10}
+LEN=${LEN:-64}
+
+ns_fw="ip netns exec fw"
+
+setup()
+{
+	ip netns add cli
+	ip netns add fw
+	ip netns add srv
+
+	ip link add c0 netns cli type veth peer name f0 netns fw
+	ip link add s0 netns srv type veth peer name f1 netns fw
+
+	ip -n cli addr add 10.0.1.2/24 dev c0
+	ip -n fw addr add 10.0.1.1/24 dev f0
+	ip -n fw addr add 10.0.2.1/24 dev f1
+	ip -n srv addr add 10.0.2.2/24 dev s0
+
+	for l in "cli c0" "fw f0" "fw f1" "srv s0" "cli lo" "fw lo" "srv lo"; do
+		ip -n ${l% *} link set ${l#* } up
+	done
+
+	ip -n cli route add default via 10.0.1.1
+	ip -n srv route add default via 10.0.2.1
+	$ns_fw sysctl -qw net.ipv4.ip_forward=1
+
+	ip netns exec srv iperf3 -s -D
+	sleep 1
+}
+
+cleanup()
+{
+	ip netns pids srv | xargs -r kill
+	ip netns del cli 2>/dev/null
+	ip netns del fw 2>/dev/null
+	ip netns del srv 2>/dev/null
+}
+
+# rules <layout> <apps>
+rules()
+{
+	{
+		echo "*mangle"
+		echo "-A FORWARD -j MARK --set-mark $2"
+		echo "COMMIT"
+		echo "*filter"
+		echo ":FORWARD DROP"
+		echo "-A FORWARD -i f1 -j ACCEPT"
+		if [ "$1" = v0 ]; then
+			i=1
+			while [ $i -le $2 ]; do
+				echo "-A FORWARD -m spstate --none -m mark --mark $i -j ACCEPT"
+				i=$((i + 1))
+			done
+		else
+			echo "-A FORWARD -m spstate --none --l7-marks 1:$2 -j ACCEPT"
+		fi
+		echo "COMMIT"
+	} | $ns_fw iptables-restore
+}
+
+# Received packets per second at the server.
+run()
+{
+	ip netns exec cli iperf3 -c 10.0.2.2 -u -b 0 -l $LEN -t $DURATION -J |
+		jq ".end.sum | (.packets - .lost_packets) / $DURATION | floor"
+}
+
+trap cleanup EXIT INT TERM
+cleanup
+setup
+
+printf "apps\tv0 pps\tv1 pps\n"
+for n in $APPS; do
+	rules v0 $n
+	v0=$(run)
+	rules v1 $n
+	v1=$(run)
+	printf "%s\t%s\t%s\n" $n $v0 $v1
+done
@@ -0,0 +1,263 @@
+/*
+ * Cost of classifying a TLS ClientHello: parsing out SNI and ALPN, then
+ * looking the server name up in domain sets of growing size.
+ *
+ * Hellos are read from the files given with -f, each holding the raw first
+ * TCP payload of one connection, e.g. written by
+ *   tshark -r cap.pcap -Y tls.handshake.type==1 -T fields -e tcp.payload
+ * and converted with xxd -r -p. Without files, hellos shaped like those of
+ * current browsers are generated: 16 extensions around SNI and ALPN, a
+ * key share and padding to 512 bytes. Half of the server names are in the
+ * largest domain set, as the name itself or below a suffix entry.
+ *
+ * build: gcc -O2 -o tls_bench bench/tls_bench.c examle/tls.c examle/domain.c -Iexamle
+ * usage: tls_bench [-f hello]... [domains...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "tls.h"
+#include "domain.h"
+
+#define HELLOS		1024
+#define HELLO_MAX	2048
+#define ROUNDS		200
+
+struct hello {
+	uint8_t data[HELLO_MAX];
+	size_t len;
+};
+
+static struct hello hellos[HELLOS];
+static unsigned int nhellos;
+
+static size_t put16(uint8_t *p, unsigned int v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+	return 2;
+}
+
+static size_t put_ext(uint8_t *p, unsigned int type, const uint8_t *data,
+		      size_t len)
+{
+	put16(p, type);
+	put16(p + 2, len);
+	if (len)
+		memcpy(p + 4, data, len);
+	return 4 + len;
+}
+
+static void name(char *buf, unsigned int i)
+{
+	sprintf(buf, "host%u.domain%u.example", i, i % 997);
+}
+
+static void make_hello(struct hello *h, const char *sni)
+{
+	static const uint8_t alpn[] = "\x00\x0c\x02h2\x08http/1.1";
+	uint8_t *p = h->data, *rec, *hs, *ext, buf[64];
+	size_t n = strlen(sni), i;
+
+	p[0] = 0x16;
+	put16(p + 1, 0x0301);
+	rec = p + 3;
+	p += 5;
+	p[0] = 0x01;
+	hs = p + 1;
+	p += 4;
+
+	p += put16(p, 0x0303);
+	for (i = 0; i < 32 + 1 + 32; i++)	/* random, session id */
+		*p++ = i == 32 ? 32 : rand();
+	p += put16(p, 32);
+	for (i = 0; i < 16; i++)
+		p += put16(p, 0x1301 + i);
+	*p++ = 1;
+	*p++ = 0;
+
+	ext = p;
+	p += 2;
+	p += put_ext(p, 0x0a0a, NULL, 0);	/* GREASE */
+	put16(buf, n + 3);
+	buf[2] = 0;
+	put16(buf + 3, n);
+	memcpy(buf + 5, sni, n);
+	p += put_ext(p, 0x0000, buf, n + 5);
+	p += put_ext(p, 0x0017, NULL, 0);
+	p += put_ext(p, 0xff01, (const uint8_t *)"\0", 1);
+	p += put_ext(p, 0x000a, (const uint8_t *)"\x00\x06\x00\x1d\x00\x17\x00\x18", 8);
+	p += put_ext(p, 0x000b, (const uint8_t *)"\x01\x00", 2);
+	p += put_ext(p, 0x0023, NULL, 0);
+	p += put_ext(p, 0x0010, alpn, sizeof(alpn) - 1);
+	p += put_ext(p, 0x0005, (const uint8_t *)"\x01\x00\x00\x00\x00", 5);
+	p += put_ext(p, 0x000d, (const uint8_t *)"\x00\x08\x04\x03\x08\x04\x04\x01\x05\x03", 10);
+	p += put_ext(p, 0x0012, NULL, 0);
+	memset(buf, 0, sizeof(buf));
+	put16(buf, 38);
+	put16(buf + 2, 0x001d);
+	put16(buf + 4, 32);
+	p += put_ext(p, 0x0033, buf, 38);
+	p += put_ext(p, 0x002d, (const uint8_t *)"\x01\x01", 2);
+	p += put_ext(p, 0x002b, (const uint8_t *)"\x04\x03\x04\x03\x03", 5);
+	p += put_ext(p, 0x001b, (const uint8_t *)"\x02\x00\x02", 3);
+	if (p - h->data < 512 - 4) {
+		n = 512 - 4 - (p - h->data);
+		put16(p, 0x0015);
+		put16(p + 2, n);
+		memset(p + 4, 0, n);
+		p += 4 + n;
+	}
+
+	put16(ext, p - ext - 2);
+	n = p - hs - 3;
+	hs[0] = n >> 16;
+	put16(hs + 1, n);
+	put16(rec, p - rec - 2);
+	h->len = p - h->data;
+}
+
+static int load_hello(const char *path)
+{
+	struct hello *h;
+	FILE *f;
+
+	if (nhellos == HELLOS)
+		return 0;
+	f = fopen(path, "rb");
+	if (!f)
+		return -1;
+	h = &hellos[nhellos++];
+	h->len = fread(h->data, 1, sizeof(h->data), f);
+	fclose(f);
+	return 0;
+}
+
+static struct domain_set *build(unsigned int count)
+{
+	struct domain_set *set;
+	char buf[64];
+	unsigned int i;
+
+	set = domain_set_new();
+	if (!set)
+		return NULL;
+	for (i = 0; i < count; i++) {
+		/* A quarter of the entries are suffixes */
+		if (i % 4)
+			name(buf, i);
+		else
+			sprintf(buf, ".domain%u.example", i);
+		if (domain_set_add(set, buf, strlen(buf), 1 + i % 255) < 0) {
+			domain_set_free(set);
+			return NULL;
+		}
+	}
+	domain_set_add(set, "@h2", 3, 256);
+	return set;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ns per hello, only parsing without a domain set */
+static double run(const struct domain_set *set, unsigned int *matched)
+{
+	volatile uint32_t sink = 0;
+	struct tls_hello hello;
+	const uint8_t *proto;
+	size_t off, len;
+	uint32_t mark;
+	unsigned int r, i;
+	double start;
+
+	*matched = 0;
+	start = now();
+	for (r = 0; r < ROUNDS; r++) {
+		for (i = 0; i < nhellos; i++) {
+			if (tls_parse_hello(hellos[i].data, hellos[i].len,
+					    &hello) == TLS_NOT_HELLO)
+				continue;
+			if (!set) {
+				sink += hello.sni_len;
+				continue;
+			}
+
+			mark = domain_lookup(set, hello.sni, hello.sni_len);
+			off = 0;
+			while (!mark && tls_alpn_next(&hello, &off, &proto, &len))
+				mark = domain_lookup_alpn(set, proto, len);
+			if (r == 0 && mark && mark != 256)
+				(*matched)++;
+			sink += mark;
+		}
+	}
+
+	return (now() - start) * 1e9 / ROUNDS / nhellos;
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned int def[] = { 100, 10000, 1000000 };
+	struct domain_set *set;
+	unsigned int count, matched, i;
+	char buf[64];
+	int opt, n;
+
+	srand(1);
+	while ((opt = getopt(argc, argv, "f:")) != -1) {
+		if (opt != 'f') {
+			fprintf(stderr, "usage: %s [-f hello]... [domains...]\n",
+				argv[0]);
+			return 1;
+		}
+		if (load_hello(optarg) < 0) {
+			fprintf(stderr, "can't read %s\n", optarg);
+			return 1;
+		}
+	}
+
+	if (!nhellos) {
+		for (i = 0; i < HELLOS; i++) {
+			/* Names of the largest set: entries, names below a
+			 * suffix entry, or not in it at all
+			 */
+			count = rand() % def[2];
+			if (i % 2)
+				sprintf(buf, "host%u.unknown.example", count);
+			else if (count % 4)
+				name(buf, count);
+			else
+				sprintf(buf, "www.domain%u.example", count);
+			make_hello(&hellos[i], buf);
+		}
+		nhellos = HELLOS;
+	}
+
+	printf("%u hellos, parse only %.0f ns\n", nhellos, run(NULL, &matched));
+
+	n = argc > optind ? argc - optind : (int)(sizeof(def) / sizeof(def[0]));
+	printf("domains\tns/hello\tmatched\n");
+	for (i = 0; i < (unsigned int)n; i++) {
+		count = argc > optind ? strtoul(argv[optind + i], NULL, 0) : def[i];
+		set = build(count);
+		if (!set) {
+			fprintf(stderr, "can't build %u domains\n", count);
+			return 1;
+		}
+
+		printf("%u\t%.0f", count, run(set, &matched));
+		printf("\t%u/%u\n", matched, nhellos);
+		domain_set_free(set);
+	}
+
+	return 0;
+}
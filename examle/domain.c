@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "domain.h"
+
+#define DOMAIN_MAX_LEN		255
+#define DOMAIN_MAX_LABELS	128
+
+#define FNV_OFFSET	0xcbf29ce484222325ULL
+#define FNV_PRIME	0x100000001b3ULL
+
+/* Open addressing over one flat array, names live in a single pool. Names
+ * are hashed from their last byte to their first, so that the hashes of all
+ * suffixes of a looked up name come out of one pass.
+ */
+struct domain_slot {
+	uint64_t hash;
+	uint32_t name;
+	uint32_t mark;
+	uint16_t len;		/* 0 for a free slot */
+	uint8_t suffix;
+};
+
+struct domain_set {
+	struct domain_slot *slots;
+	uint32_t mask;
+	unsigned int count;
+	char *names;
+	size_t names_len;
+	size_t names_size;
+};
+
+static inline uint8_t lower(uint8_t c)
+{
+	return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c;
+}
+
+static uint64_t hash_rev(const uint8_t *p, size_t len)
+{
+	uint64_t h = FNV_OFFSET;
+
+	while (len--)
+		h = (h ^ lower(p[len])) * FNV_PRIME;
+	return h;
+}
+
+static int name_eq(const char *a, const uint8_t *b, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((uint8_t)a[i] != lower(b[i]))
+			return 0;
+	}
+	return 1;
+}
+
+struct domain_set *domain_set_new(void)
+{
+	struct domain_set *set;
+
+	set = calloc(1, sizeof(*set));
+	if (!set)
+		return NULL;
+
+	set->mask = 63;
+	set->slots = calloc(set->mask + 1, sizeof(*set->slots));
+	if (!set->slots) {
+		free(set);
+		return NULL;
+	}
+	return set;
+}
+
+void domain_set_free(struct domain_set *set)
+{
+	if (!set)
+		return;
+	free(set->slots);
+	free(set->names);
+	free(set);
+}
+
+unsigned int domain_set_count(const struct domain_set *set)
+{
+	return set->count;
+}
+
+static struct domain_slot *find(const struct domain_set *set, uint64_t hash,
+				const uint8_t *name, size_t len, int suffix)
+{
+	struct domain_slot *slot;
+	uint32_t i;
+
+	for (i = hash & set->mask; ; i = (i + 1) & set->mask) {
+		slot = &set->slots[i];
+		if (slot->len == 0)
+			return slot;
+		if (slot->hash == hash && slot->len == len &&
+		    slot->suffix == suffix &&
+		    name_eq(set->names + slot->name, name, len))
+			return slot;
+	}
+}
+
+static int grow(struct domain_set *set)
+{
+	struct domain_slot *old = set->slots, *slot;
+	uint32_t i, mask = set->mask;
+
+	set->slots = calloc((size_t)(mask + 1) * 2, sizeof(*set->slots));
+	if (!set->slots) {
+		set->slots = old;
+		return -ENOMEM;
+	}
+	set->mask = mask * 2 + 1;
+
+	for (i = 0; i <= mask; i++) {
+		if (!old[i].len)
+			continue;
+		for (slot = &set->slots[old[i].hash & set->mask]; slot->len;
+		     slot = &set->slots[(slot - set->slots + 1) & set->mask])
+			;
+		*slot = old[i];
+	}
+
+	free(old);
+	return 0;
+}
+
+int domain_set_add(struct domain_set *set, const char *name, size_t len,
+		   uint32_t mark)
+{
+	struct domain_slot *slot;
+	uint8_t buf[DOMAIN_MAX_LEN];
+	int suffix = 0;
+	size_t i;
+	char *names;
+
+	if (len && name[len - 1] == '.')
+		len--;
+	if (len && name[0] == '.') {
+		suffix = 1;
+		name++;
+		len--;
+	}
+	if (len == 0 || len > DOMAIN_MAX_LEN || mark == 0)
+		return -EINVAL;
+
+	for (i = 0; i < len; i++)
+		buf[i] = lower(name[i]);
+
+	if ((set->count + 1) * 2 > set->mask + 1 && grow(set) < 0)
+		return -ENOMEM;
+
+	slot = find(set, hash_rev(buf, len), buf, len, suffix);
+	if (slot->len) {
+		slot->mark = mark;
+		return 0;
+	}
+
+	if (set->names_len + len > set->names_size) {
+		size_t size = set->names_size ? set->names_size * 2 : 4096;
+
+		while (size < set->names_len + len)
+			size *= 2;
+		names = realloc(set->names, size);
+		if (!names)
+			return -ENOMEM;
+		set->names = names;
+		set->names_size = size;
+	}
+
+	memcpy(set->names + set->names_len, buf, len);
+	slot->hash = hash_rev(buf, len);
+	slot->name = set->names_len;
+	slot->len = len;
+	slot->suffix = suffix;
+	slot->mark = mark;
+	set->names_len += len;
+	set->count++;
+	return 0;
+}
+
+int domain_set_load(struct domain_set *set, const char *path)
+{
+	char line[512], *p, *end, *name;
+	unsigned long mark;
+	unsigned int n = 0;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		mark = strtoul(p, &end, 0);
+		for (name = end; isspace((unsigned char)*name); name++)
+			;
+		for (p = name; *p && !isspace((unsigned char)*p); p++)
+			;
+
+		err = end == line || name == end || mark > UINT32_MAX ? -EINVAL :
+		      domain_set_add(set, name, p - name, mark);
+		if (err < 0) {
+			fprintf(stderr, "%s:%u: bad domain\n", path, n);
+			break;
+		}
+	}
+
+	fclose(f);
+	return err;
+}
+
+uint32_t domain_lookup(const struct domain_set *set, const uint8_t *host,
+		       size_t len)
+{
+	struct {
+		size_t off;
+		uint64_t hash;
+	} suffixes[DOMAIN_MAX_LABELS];
+	const struct domain_slot *slot;
+	uint64_t h = FNV_OFFSET;
+	unsigned int n = 0;
+	size_t i;
+
+	if (len && host[len - 1] == '.')
+		len--;
+	if (len == 0 || len > DOMAIN_MAX_LEN)
+		return 0;
+
+	/* Suffixes starting after a dot, from the shortest to the name */
+	for (i = len; i-- > 0; ) {
+		h = (h ^ lower(host[i])) * FNV_PRIME;
+		if ((i == 0 || host[i - 1] == '.') && n < DOMAIN_MAX_LABELS) {
+			suffixes[n].off = i;
+			suffixes[n].hash = h;
+			n++;
+		}
+	}
+	if (n == 0 || suffixes[n - 1].off != 0)
+		return 0;
+
+	slot = find(set, h, host, len, 0);
+	if (slot->len)
+		return slot->mark;
+
+	while (n--) {
+		i = suffixes[n].off;
+		slot = find(set, suffixes[n].hash, host + i, len - i, 1);
+		if (slot->len)
+			return slot->mark;
+	}
+	return 0;
+}
+
+uint32_t domain_lookup_alpn(const struct domain_set *set,
+			    const uint8_t *proto, size_t len)
+{
+	const struct domain_slot *slot;
+	uint8_t buf[DOMAIN_MAX_LEN];
+
+	if (len == 0 || len >= DOMAIN_MAX_LEN)
+		return 0;
+
+	buf[0] = '@';
+	memcpy(buf + 1, proto, len);
+	slot = find(set, hash_rev(buf, len + 1), buf, len + 1, 0);
+	return slot->len ? slot->mark : 0;
+}
@@ -0,0 +1,27 @@
+#ifndef DOMAIN_H
+#define DOMAIN_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Host names and ALPN protocols mapped to L7 marks. "example.com" matches
+ * the name only, ".example.com" the name and all names below it, the
+ * longest match wins. "@h2" matches the ALPN protocol h2.
+ */
+struct domain_set;
+
+struct domain_set *domain_set_new(void);
+void domain_set_free(struct domain_set *set);
+int domain_set_add(struct domain_set *set, const char *name, size_t len,
+		   uint32_t mark);
+/* One "<mark> <name>" per line, '#' starts a comment */
+int domain_set_load(struct domain_set *set, const char *path);
+unsigned int domain_set_count(const struct domain_set *set);
+
+/* 0 if nothing matches. Case-insensitive, a trailing dot is ignored. */
+uint32_t domain_lookup(const struct domain_set *set, const uint8_t *host,
+		       size_t len);
+uint32_t domain_lookup_alpn(const struct domain_set *set,
+			    const uint8_t *proto, size_t len);
+
+#endif /* DOMAIN_H */
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "flow.h"
+
+#define FLOW_NO_BUF	UINT32_MAX
+
+/* Open addressing with linear probing over twice as many slots as flows,
+ * deleted slots are filled by shifting the following entries back. Stream
+ * buffers come from one pool and are handed out from a free list.
+ */
+struct flow_table {
+	struct flow *slots;
+	uint32_t mask;
+	uint32_t hand;
+	uint64_t seed;
+	unsigned int count;
+	unsigned int max_flows;
+	unsigned int timeout;
+	unsigned int stream_len;
+	uint8_t *pool;
+	uint32_t *free_bufs;
+	unsigned int nfree;
+};
+
+static uint32_t hash_key(const struct flow_table *t, const uint32_t *addr,
+			 const uint16_t *port)
+{
+	uint64_t h;
+
+	h = ((uint64_t)addr[0] << 32 | addr[1]) ^ t->seed;
+	h *= 0x9e3779b97f4a7c15ULL;
+	h ^= ((uint64_t)port[0] << 16 | port[1]) * 0xc2b2ae3d27d4eb4fULL;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 32;
+	return h;
+}
+
+struct flow_table *flow_table_new(unsigned int max_flows, unsigned int buffers,
+				  unsigned int stream_len, unsigned int timeout)
+{
+	struct flow_table *t;
+	uint32_t size = 2;
+	unsigned int i;
+
+	if (!max_flows || stream_len > UINT16_MAX)
+		return NULL;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+
+	while (size < 2 * max_flows)
+		size *= 2;
+	t->mask = size - 1;
+	t->max_flows = max_flows;
+	t->timeout = timeout;
+	t->stream_len = stream_len;
+	t->seed = (uint64_t)time(NULL) * 0x2545f4914f6cdd1dULL ^ (uintptr_t)t;
+
+	t->slots = calloc(size, sizeof(*t->slots));
+	t->pool = malloc((size_t)buffers * 2 * stream_len);
+	t->free_bufs = malloc(buffers * sizeof(*t->free_bufs));
+	if (!t->slots || (buffers && (!t->pool || !t->free_bufs))) {
+		flow_table_free(t);
+		return NULL;
+	}
+
+	for (i = 0; i < buffers; i++)
+		t->free_bufs[i] = buffers - 1 - i;
+	t->nfree = buffers;
+	return t;
+}
+
+void flow_table_free(struct flow_table *t)
+{
+	if (!t)
+		return;
+	free(t->slots);
+	free(t->pool);
+	free(t->free_bufs);
+	free(t);
+}
+
+unsigned int flow_count(const struct flow_table *t)
+{
+	return t->count;
+}
+
+static void put_buf(struct flow_table *t, struct flow *f)
+{
+	if (f->buf == FLOW_NO_BUF)
+		return;
+	t->free_bufs[t->nfree++] = f->buf;
+	f->buf = FLOW_NO_BUF;
+}
+
+static void delete_slot(struct flow_table *t, uint32_t i)
+{
+	uint32_t j, home;
+
+	put_buf(t, &t->slots[i]);
+
+	/* Move back every following entry whose home slot is not between
+	 * the hole and its current slot
+	 */
+	for (j = (i + 1) & t->mask; t->slots[j].used; j = (j + 1) & t->mask) {
+		home = t->slots[j].hash & t->mask;
+		if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+			t->slots[i] = t->slots[j];
+			i = j;
+		}
+	}
+
+	t->slots[i].used = 0;
+	t->count--;
+}
+
+void flow_delete(struct flow_table *t, struct flow *f)
+{
+	delete_slot(t, f - t->slots);
+}
+
+static int expired(const struct flow_table *t, const struct flow *f,
+		   uint32_t now)
+{
+	return now - f->last_seen > t->timeout;
+}
+
+void flow_expire(struct flow_table *t, uint32_t now, unsigned int count)
+{
+	while (count--) {
+		/* A shifted entry lands on the hand, look at it again */
+		if (t->slots[t->hand].used && expired(t, &t->slots[t->hand], now))
+			delete_slot(t, t->hand);
+		else
+			t->hand = (t->hand + 1) & t->mask;
+	}
+}
+
+static struct flow *find(struct flow_table *t, const uint32_t *addr,
+			 const uint16_t *port, uint32_t hash)
+{
+	struct flow *f;
+	uint32_t i;
+
+	for (i = hash & t->mask; ; i = (i + 1) & t->mask) {
+		f = &t->slots[i];
+		if (!f->used ||
+		    (f->hash == hash && f->addr[0] == addr[0] &&
+		     f->addr[1] == addr[1] && f->port[0] == port[0] &&
+		     f->port[1] == port[1]))
+			return f;
+	}
+}
+
+static void flow_init(struct flow *f, uint32_t now)
+{
+	f->last_seen = now;
+	f->mark = 0;
+	f->buf = FLOW_NO_BUF;
+	memset(f->dir, 0, sizeof(f->dir));
+}
+
+struct flow *flow_lookup(struct flow_table *t, const struct flow_pkt *p,
+			 uint32_t now, int *dir)
+{
+	uint32_t addr[2], hash;
+	uint16_t port[2];
+	struct flow *f;
+
+	*dir = p->saddr > p->daddr ||
+	       (p->saddr == p->daddr && p->sport > p->dport);
+	addr[*dir] = p->saddr;
+	addr[!*dir] = p->daddr;
+	port[*dir] = p->sport;
+	port[!*dir] = p->dport;
+	hash = hash_key(t, addr, port);
+
+	f = find(t, addr, port, hash);
+	if (f->used) {
+		/* An idle flow with the same tuple is a new connection */
+		if (expired(t, f, now)) {
+			put_buf(t, f);
+			flow_init(f, now);
+		}
+		f->last_seen = now;
+		return f;
+	}
+
+	if (t->count >= t->max_flows) {
+		flow_expire(t, now, 64);
+		if (t->count >= t->max_flows)
+			return NULL;
+		f = find(t, addr, port, hash);
+	}
+
+	memcpy(f->addr, addr, sizeof(addr));
+	memcpy(f->port, port, sizeof(port));
+	f->hash = hash;
+	f->used = 1;
+	flow_init(f, now);
+	t->count++;
+	return f;
+}
+
+/* Records that [start, end) was received */
+static void add_range(struct flow_dir *d, unsigned int start, unsigned int end)
+{
+	unsigned int i, j;
+
+	if (start <= d->contig) {
+		if (end > d->contig)
+			d->contig = end;
+	} else {
+		for (i = 0; i < d->nranges && d->ranges[i].end < start; i++)
+			;
+		if (i < d->nranges && d->ranges[i].start <= end) {
+			if (start < d->ranges[i].start)
+				d->ranges[i].start = start;
+			if (end > d->ranges[i].end)
+				d->ranges[i].end = end;
+			/* The grown range may reach the next ones */
+			for (j = i + 1; j < d->nranges &&
+			     d->ranges[j].start <= d->ranges[i].end; j++) {
+				if (d->ranges[j].end > d->ranges[i].end)
+					d->ranges[i].end = d->ranges[j].end;
+			}
+			memmove(&d->ranges[i + 1], &d->ranges[j],
+				(d->nranges - j) * sizeof(d->ranges[0]));
+			d->nranges -= j - i - 1;
+		} else if (d->nranges < FLOW_RANGES) {
+			memmove(&d->ranges[i + 1], &d->ranges[i],
+				(d->nranges - i) * sizeof(d->ranges[0]));
+			d->ranges[i].start = start;
+			d->ranges[i].end = end;
+			d->nranges++;
+		}
+		/* Otherwise the bytes wait for a retransmission */
+	}
+
+	while (d->nranges && d->ranges[0].start <= d->contig) {
+		if (d->ranges[0].end > d->contig)
+			d->contig = d->ranges[0].end;
+		d->nranges--;
+		memmove(&d->ranges[0], &d->ranges[1],
+			d->nranges * sizeof(d->ranges[0]));
+	}
+}
+
+uint32_t flow_input(struct flow_table *t, struct flow *f, int dir,
+		    const struct flow_pkt *p, flow_classify_fn classify,
+		    void *arg)
+{
+	struct flow_dir *d = &f->dir[dir];
+	const uint8_t *data = p->data;
+	size_t len = p->len;
+	unsigned int contig;
+	uint8_t *buf;
+	int32_t off;
+
+	if (f->mark)
+		return f->mark;
+
+	if ((p->flags & FLOW_SYN) && !d->contig && !d->nranges) {
+		d->base = p->seq + 1;
+		d->has_base = 1;
+	}
+	if (!len)
+		return 0;
+	/* Without the SYN the stream starts at the first segment seen */
+	if (!d->has_base) {
+		d->base = p->seq;
+		d->has_base = 1;
+	}
+
+	off = p->seq - d->base;
+	if (off < 0) {
+		if ((size_t)-off >= len)
+			return 0;
+		data -= off;
+		len += off;
+		off = 0;
+	}
+	if ((unsigned int)off >= t->stream_len)
+		return 0;
+	if (len > t->stream_len - off)
+		len = t->stream_len - off;
+	if (off + len <= d->contig)
+		return 0;
+
+	/* The common case, everything is in the first segment */
+	if (off == 0 && d->contig == 0) {
+		f->mark = classify(arg, data, len);
+		if (f->mark) {
+			put_buf(t, f);
+			return f->mark;
+		}
+	}
+
+	if (f->buf == FLOW_NO_BUF) {
+		/* Out of buffers, the segment is classified on its own */
+		if (!t->nfree) {
+			if (off != 0 || d->contig != 0)
+				f->mark = classify(arg, data, len);
+			return f->mark;
+		}
+		f->buf = t->free_bufs[--t->nfree];
+	}
+
+	buf = t->pool + ((size_t)f->buf * 2 + dir) * t->stream_len;
+	memcpy(buf + off, data, len);
+	contig = d->contig;
+	add_range(d, off, off + len);
+
+	if (d->contig != contig && !(off == 0 && contig == 0 &&
+				     d->contig == len)) {
+		f->mark = classify(arg, buf, d->contig);
+		if (f->mark)
+			put_buf(t, f);
+	}
+	return f->mark;
+}
@@ -0,0 +1,80 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define FLOW_SYN	0x01
+#define FLOW_FIN	0x02
+#define FLOW_RST	0x04
+
+/* Out of order ranges remembered per direction */
+#define FLOW_RANGES	4
+
+/* Header fields of a TCP segment, addresses and ports in network order */
+struct flow_pkt {
+	uint32_t saddr;
+	uint32_t daddr;
+	uint16_t sport;
+	uint16_t dport;
+	uint32_t seq;
+	uint8_t flags;
+	const uint8_t *data;
+	size_t len;
+};
+
+struct flow_dir {
+	uint32_t base;		/* sequence number of the first byte */
+	uint16_t contig;	/* bytes from base without a gap */
+	uint8_t has_base;
+	uint8_t nranges;
+	struct {
+		uint16_t start;
+		uint16_t end;
+	} ranges[FLOW_RANGES];	/* received after the gap, sorted */
+};
+
+/* Directions are numbered by the endpoint that sends them, endpoint 0 has
+ * the lower address and port.
+ */
+struct flow {
+	uint32_t addr[2];
+	uint16_t port[2];
+	uint32_t hash;
+	uint32_t last_seen;
+	uint32_t mark;
+	uint32_t buf;
+	uint8_t used;
+	struct flow_dir dir[2];
+};
+
+struct flow_table;
+
+/* Room for max_flows flows, of which up to buffers reassemble stream_len
+ * bytes of each direction. All memory is allocated here.
+ */
+struct flow_table *flow_table_new(unsigned int max_flows, unsigned int buffers,
+				  unsigned int stream_len, unsigned int timeout);
+void flow_table_free(struct flow_table *t);
+unsigned int flow_count(const struct flow_table *t);
+
+/* Finds or adds the flow of a packet, NULL if the table is full. */
+struct flow *flow_lookup(struct flow_table *t, const struct flow_pkt *p,
+			 uint32_t now, int *dir);
+void flow_delete(struct flow_table *t, struct flow *f);
+/* Deletes idle flows among the next count slots */
+void flow_expire(struct flow_table *t, uint32_t now, unsigned int count);
+
+typedef uint32_t (*flow_classify_fn)(void *arg, const uint8_t *data,
+				     size_t len);
+
+/* Adds the payload to its direction and calls classify with arg on the
+ * contiguous prefix whenever it grows. A segment starting the stream is
+ * classified in place and only copied if it does not match. Returns the
+ * mark, which is also kept in the flow, 0 if there is none yet.
+ */
+uint32_t flow_input(struct flow_table *t, struct flow *f, int dir,
+		    const struct flow_pkt *p, flow_classify_fn classify,
+		    void *arg);
+
+#endif /* FLOW_H */
@@ -1,92 +1,824 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <linux/types.h>
-#include <linux/netfilter.h>		
+#include <linux/netfilter.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
 #include <libnetfilter_queue/libnetfilter_queue.h>
 #include <linux/ip.h>
 #include <linux/tcp.h>
 
+#include "sig.h"
+#include "tls.h"
+#include "domain.h"
+#include "flow.h"
+
+#ifndef SOL_NETLINK
+#define SOL_NETLINK	270
+#endif
+
+/* Room for the netlink and queue attributes besides the packet */
+#define RECV_MSG_OVERHEAD	4096
+
+/* Seconds until an idle flow is forgotten */
+#define FLOW_TIMEOUT		30
+
+/* Verdicts out of band, see the SYNPROXY_DPI family in ipt_SYNPROXY.c */
+#define SYNPROXY_DPI_GENL_NAME		"SYNPROXY_DPI"
+#define SYNPROXY_DPI_GENL_VERSION	1
+#define SYNPROXY_DPI_CMD_VERDICT	1
+#define SYNPROXY_DPI_A_SADDR		1
+#define SYNPROXY_DPI_A_DADDR		2
+#define SYNPROXY_DPI_A_SPORT		3
+#define SYNPROXY_DPI_A_DPORT		4
+#define SYNPROXY_DPI_A_MARK		5
+#define SYNPROXY_DPI_A_FLAGS		6
+#define SYNPROXY_DPI_A_ZONE		7
+#define SYNPROXY_DPI_F_START		0x01
+
+/* Verdict messages collected before they are sent with one syscall */
+#define OOB_BUF_SIZE		16384
+#define OOB_MSG_SIZE		128
+
+/* One worker per queue, pinned to a CPU. Up to recv_batch netlink messages
+ * are read per syscall, verdicts of consecutive packets with the same mark
+ * are sent as one batch.
+ */
+struct worker {
+	struct nfq_handle *h;
+	struct nfq_q_handle *qh;
+	pthread_t thread;
+	int queue;
+	int cpu;
+	char *buf;
+	struct mmsghdr *msgs;
+	struct iovec *iov;
+	uint32_t batch_id;
+	uint32_t batch_mark;
+	unsigned int batch_count;
+	struct flow_table *flows;
+	uint32_t now;
+	struct sig_matcher *matcher;	/* used by the current batch */
+	int genl_fd;
+	char *oob_buf;
+	size_t oob_len;
+	uint32_t oob_seq;
+};
+
+static unsigned int batch_max = 64;
+static unsigned int recv_batch = 32;
+static unsigned int copy_range = 1024;
+static int gso = 1;
+static unsigned int rcvbuf_size = 16 << 20;
+static unsigned int queue_maxlen = 4096;
+static uint32_t done_mark = 0x80000000;
+static unsigned int max_flows = 65536;
+static unsigned int flow_buffers = 4096;
+static unsigned int stream_len = 2048;
+static int fail_open;
+static int verbose;
+static const char *sig_file;
+static const char *image_file;
+static int oob;
+static uint16_t oob_family;
+static int oob_zone = -1;
+/* L7 marks that allow a connection, see -o */
+static uint32_t oob_start[256 / 32];
+/* Replaced on SIGHUP, see matcher_get() */
+static struct sig_matcher *matcher;
+static struct domain_set *domains;
+
+/* Used without a signature file */
+static const char *const default_sigs[] = {
+	"11 ^GET ",
+};
+
+/* A ClientHello is classified by its server name, then by the first ALPN
+ * protocol with a mark.
+ */
+static uint32_t classify_tls(const uint8_t *data, size_t len)
+{
+	struct tls_hello hello;
+	const uint8_t *proto;
+	size_t off = 0, proto_len;
+	uint32_t mark = 0;
+
+	if (data[0] != 0x16 ||
+	    tls_parse_hello(data, len, &hello) == TLS_NOT_HELLO)
+		return 0;
+
+	if (hello.sni_len)
+		mark = domain_lookup(domains, hello.sni, hello.sni_len);
+	while (!mark && tls_alpn_next(&hello, &off, &proto, &proto_len))
+		mark = domain_lookup_alpn(domains, proto, proto_len);
+	return mark;
+}
+
+/* Returns the L7 mark of the start of a stream, 0 if it is not known. */
+static uint32_t classify_stream(void *arg, const uint8_t *data, size_t len)
+{
+	struct worker *w = arg;
+	uint32_t mark;
+
+	mark = domains ? classify_tls(data, len) : 0;
+	if (!mark)
+		mark = sig_match(w->matcher, data, len);
+	return mark;
+}
+
+static int parse_tcp(const struct iphdr *iph, int len, struct flow_pkt *p)
+{
+	const struct tcphdr *tcp;
+	const uint8_t *data;
+
+	if (len < (int)sizeof(*iph) || iph->protocol != IPPROTO_TCP)
+		return -1;
+
+	tcp = (const struct tcphdr *)((const uint8_t *)iph + iph->ihl * 4);
+	if ((const char *)(tcp + 1) > (const char *)iph + len)
+		return -1;
+
+	data = (const uint8_t *)tcp + tcp->doff * 4;
+	if (data > (const uint8_t *)iph + len)
+		return -1;
+
+	p->saddr = iph->saddr;
+	p->daddr = iph->daddr;
+	p->sport = tcp->source;
+	p->dport = tcp->dest;
+	p->seq = ntohl(tcp->seq);
+	p->flags = (tcp->syn ? FLOW_SYN : 0) | (tcp->fin ? FLOW_FIN : 0) |
+		   (tcp->rst ? FLOW_RST : 0);
+	p->data = data;
+	/* Only the copied part of the segment, the rest is a gap */
+	p->len = (const uint8_t *)iph + len - data;
+	return 0;
+}
+
+static void nl_put_attr(struct nlmsghdr *nlh, int type, const void *data,
+			size_t len)
+{
+	struct nlattr *nla;
+
+	nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy((char *)nla + NLA_HDRLEN, data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+/* Asks the generic netlink controller for the id of the module's family */
+static int oob_resolve(void)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct genlmsghdr genl;
+		char attrs[64];
+	} req;
+	char buf[4096];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct nlattr *nla;
+	int fd, len, attrs_len;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd < 0)
+		return -1;
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.nlh.nlmsg_type = GENL_ID_CTRL;
+	req.nlh.nlmsg_flags = NLM_F_REQUEST;
+	req.genl.cmd = CTRL_CMD_GETFAMILY;
+	req.genl.version = 1;
+	nl_put_attr(&req.nlh, CTRL_ATTR_FAMILY_NAME, SYNPROXY_DPI_GENL_NAME,
+		    sizeof(SYNPROXY_DPI_GENL_NAME));
+
+	if (send(fd, &req, req.nlh.nlmsg_len, 0) < 0 ||
+	    (len = recv(fd, buf, sizeof(buf), 0)) < 0) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (!NLMSG_OK(nlh, len) || nlh->nlmsg_type == NLMSG_ERROR) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	nla = (struct nlattr *)((char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+	attrs_len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	while (attrs_len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN &&
+	       nla->nla_len <= attrs_len) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID) {
+			oob_family = *(uint16_t *)((char *)nla + NLA_HDRLEN);
+			return 0;
+		}
+		attrs_len -= NLA_ALIGN(nla->nla_len);
+		nla = (struct nlattr *)((char *)nla + NLA_ALIGN(nla->nla_len));
+	}
+	errno = ENOENT;
+	return -1;
+}
+
+/* The module answers only verdicts it could not parse */
+static void oob_flush(struct worker *w)
+{
+	char buf[1024];
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+	struct nlmsgerr *err;
+	int len;
+
+	if (!w->oob_len)
+		return;
+
+	if (send(w->genl_fd, w->oob_buf, w->oob_len, 0) < 0)
+		fprintf(stderr, "queue %d: can't send verdicts: %s\n", w->queue,
+			strerror(errno));
+	w->oob_len = 0;
+
+	while ((len = recv(w->genl_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		for (; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+			err = NLMSG_DATA(nlh);
+			if (nlh->nlmsg_type == NLMSG_ERROR && err->error)
+				fprintf(stderr, "queue %d: verdict rejected: %s\n",
+					w->queue, strerror(-err->error));
+		}
+		nlh = (struct nlmsghdr *)buf;
+	}
+}
+
+/* Adds the verdict for the packet's connection to the next batch */
+static void oob_add(struct worker *w, const struct flow_pkt *p, uint32_t mark)
+{
+	struct genlmsghdr *genl;
+	struct nlmsghdr *nlh;
+	uint32_t flags = 0;
+
+	if (w->oob_len + OOB_MSG_SIZE > OOB_BUF_SIZE)
+		oob_flush(w);
+
+	if (mark < 256 && oob_start[mark / 32] & (1U << (mark % 32)))
+		flags |= SYNPROXY_DPI_F_START;
+
+	nlh = (struct nlmsghdr *)(w->oob_buf + w->oob_len);
+	memset(nlh, 0, NLMSG_LENGTH(GENL_HDRLEN));
+	nlh->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	nlh->nlmsg_type = oob_family;
+	nlh->nlmsg_flags = NLM_F_REQUEST;
+	nlh->nlmsg_seq = ++w->oob_seq;
+	genl = NLMSG_DATA(nlh);
+	genl->cmd = SYNPROXY_DPI_CMD_VERDICT;
+	genl->version = SYNPROXY_DPI_GENL_VERSION;
+
+	nl_put_attr(nlh, SYNPROXY_DPI_A_SADDR, &p->saddr, sizeof(p->saddr));
+	nl_put_attr(nlh, SYNPROXY_DPI_A_DADDR, &p->daddr, sizeof(p->daddr));
+	nl_put_attr(nlh, SYNPROXY_DPI_A_SPORT, &p->sport, sizeof(p->sport));
+	nl_put_attr(nlh, SYNPROXY_DPI_A_DPORT, &p->dport, sizeof(p->dport));
+	nl_put_attr(nlh, SYNPROXY_DPI_A_MARK, &mark, sizeof(mark));
+	nl_put_attr(nlh, SYNPROXY_DPI_A_FLAGS, &flags, sizeof(flags));
+	if (oob_zone >= 0) {
+		uint16_t zone = oob_zone;
+
+		nl_put_attr(nlh, SYNPROXY_DPI_A_ZONE, &zone, sizeof(zone));
+	}
+	w->oob_len += NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+/* Returns the L7 mark of the packet's connection, 0 if it is not known. A
+ * packet is classified on its own when flows are not tracked or the table
+ * is full. With verdicts out of band the mark goes to the module instead and
+ * the packet is released unmarked.
+ */
+static uint32_t classify(struct worker *w, const struct iphdr *iph, int len)
+{
+	struct flow_pkt p;
+	struct flow *f;
+	uint32_t mark;
+	int dir;
+
+	if (parse_tcp(iph, len, &p) < 0)
+		return 0;
+
+	f = w->flows ? flow_lookup(w->flows, &p, w->now, &dir) : NULL;
+	if (f) {
+		mark = flow_input(w->flows, f, dir, &p, classify_stream, w);
+		/* With done bits later packets of a classified flow are not
+		 * queued, without them the flow keeps its mark until it ends.
+		 */
+		if ((mark && done_mark) || (p.flags & (FLOW_FIN | FLOW_RST)))
+			flow_delete(w->flows, f);
+	} else {
+		mark = p.len ? classify_stream(w, p.data, p.len) : 0;
+	}
+
+	if (mark && verbose)
+		printf("catch TCP -> %#x\n", mark);
+	if (mark && oob) {
+		oob_add(w, &p, mark);
+		return 0;
+	}
+	return mark;
+}
+
+/* Classified packets carry the done bits, the module records that DPI is
+ * done with the connection and later packets of it are not queued. Verdicts
+ * out of band go first, the packets they start a connection for are dropped
+ * anyway.
+ */
+static void flush_verdicts(struct worker *w)
+{
+	oob_flush(w);
+	if (!w->batch_count)
+		return;
+
+	if (w->batch_mark)
+		nfq_set_verdict_batch2(w->qh, w->batch_id, NF_ACCEPT,
+				       w->batch_mark | done_mark);
+	else
+		nfq_set_verdict_batch(w->qh, w->batch_id, NF_ACCEPT);
+	w->batch_count = 0;
+}
+
 static int cb(struct nfq_q_handle *qh, struct nfgenmsg *nfmsg, struct nfq_data *nfa, void *data)
 {
-	u_int32_t id;
-	const struct iphdr *iph;
-	int ret = 0;
-	uint32_t data_len;
-	int packet_id;
-	struct nfqnl_msg_packet_hdr* nfq_ph = nfq_get_msg_packet_hdr(nfa);
-	packet_id = ntohl(nfq_ph->packet_id);
+	struct worker *w = data;
+	struct nfqnl_msg_packet_hdr *nfq_ph = nfq_get_msg_packet_hdr(nfa);
+	unsigned char *payload;
+	uint32_t id, mark;
+	int len;
 
-	ret = nfq_get_payload(nfa, (unsigned char**) &iph);
 	id = ntohl(nfq_ph->packet_id);
+	len = nfq_get_payload(nfa, &payload);
+	mark = len > 0 ? classify(w, (const struct iphdr *)payload, len) : 0;
 
-	if (iph->protocol == IPPROTO_TCP) {
-		struct tcphdr *tcp = (struct tcphdr *)((uint8_t *)iph + iph->ihl * 4);
-		char *data = (char *)tcp + tcp->doff * 4;
-		uint16_t data_len = ntohs(iph->tot_len) - (data - (char *)iph);
+	/* A batch verdict covers all packets up to its id, so a packet with
+	 * another mark closes the batch.
+	 */
+	if (w->batch_count && mark != w->batch_mark)
+		flush_verdicts(w);
+
+	w->batch_id = id;
+	w->batch_mark = mark;
+	if (++w->batch_count >= batch_max)
+		flush_verdicts(w);
+
+	return 0;
+}
+
+/* A worker announces the matcher it uses for a batch of packets. After
+ * replacing the matcher, the old one is freed once no worker announces it,
+ * so packets being classified finish with the matcher they started with.
+ */
+static void matcher_get(struct worker *w)
+{
+	struct sig_matcher *m;
+
+	do {
+		m = __atomic_load_n(&matcher, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&w->matcher, m, __ATOMIC_SEQ_CST);
+	} while (m != __atomic_load_n(&matcher, __ATOMIC_SEQ_CST));
+}
+
+static void matcher_put(struct worker *w)
+{
+	__atomic_store_n(&w->matcher, NULL, __ATOMIC_RELEASE);
+}
 
-		/* This is just an example, so there are no sanity checks here. */
-		if (data_len > 4) {
-			if (!memcmp(data, "GET ", 4)) {
-				printf("catch TCP -> HTTP\n");
-				return nfq_set_verdict2(qh, id, NF_ACCEPT, 11, 0, NULL);
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	int fd = nfq_fd(w->h);
+	struct timespec ts;
+	int i, rv;
+
+	for (;;) {
+		/* Verdicts wait while more packets are queued on the socket */
+		rv = recvmmsg(fd, w->msgs, recv_batch,
+			      w->batch_count ? MSG_DONTWAIT : MSG_WAITFORONE,
+			      NULL);
+		if (rv < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				flush_verdicts(w);
+				continue;
 			}
+			if (errno == EINTR || errno == ENOBUFS)
+				continue;
+			fprintf(stderr, "queue %d: recv: %s\n", w->queue,
+				strerror(errno));
+			kill(getpid(), SIGTERM);
+			break;
+		}
+
+		if (w->flows) {
+			clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+			w->now = ts.tv_sec;
+			flow_expire(w->flows, w->now, 2 * rv);
 		}
+		matcher_get(w);
+		for (i = 0; i < rv; i++)
+			nfq_handle_packet(w->h, w->iov[i].iov_base,
+					  w->msgs[i].msg_len);
+		matcher_put(w);
 	}
-	return nfq_set_verdict(qh, id, NF_ACCEPT, 0, NULL);
+
+	flush_verdicts(w);
+	return NULL;
 }
 
-int main(int argc, char **argv)
+static void worker_init(struct worker *w, int bind_pf)
 {
-	struct nfq_handle *h;
-	struct nfq_q_handle *qh;
+	size_t msg_size = copy_range + RECV_MSG_OVERHEAD;
+	unsigned int i;
+	int one = 1;
 	int fd;
-	int rv;
-	char buf[4096] __attribute__ ((aligned));
 
-	h = nfq_open();
-	if (!h) {
+	w->buf = malloc(recv_batch * msg_size);
+	w->msgs = calloc(recv_batch, sizeof(*w->msgs));
+	w->iov = calloc(recv_batch, sizeof(*w->iov));
+	if (!w->buf || !w->msgs || !w->iov) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	if (oob) {
+		w->genl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+				    NETLINK_GENERIC);
+		w->oob_buf = malloc(OOB_BUF_SIZE);
+		if (w->genl_fd < 0 || !w->oob_buf) {
+			fprintf(stderr, "can't open verdict socket\n");
+			exit(1);
+		}
+	}
+
+	if (max_flows) {
+		w->flows = flow_table_new(max_flows, flow_buffers, stream_len,
+					  FLOW_TIMEOUT);
+		if (!w->flows) {
+			fprintf(stderr, "can't allocate %u flows\n", max_flows);
+			exit(1);
+		}
+	}
+
+	for (i = 0; i < recv_batch; i++) {
+		w->iov[i].iov_base = w->buf + i * msg_size;
+		w->iov[i].iov_len = msg_size;
+		w->msgs[i].msg_hdr.msg_iov = &w->iov[i];
+		w->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	w->h = nfq_open();
+	if (!w->h) {
 		fprintf(stderr, "error during nfq_open()\n");
 		exit(1);
 	}
 
-	if (nfq_unbind_pf(h, AF_INET) < 0) {
-		fprintf(stderr, "error during nfq_unbind_pf()\n");
+	/* Only needed with kernels before 3.8, where binding is global */
+	if (bind_pf) {
+		if (nfq_unbind_pf(w->h, AF_INET) < 0) {
+			fprintf(stderr, "error during nfq_unbind_pf()\n");
+			exit(1);
+		}
+
+		if (nfq_bind_pf(w->h, AF_INET) < 0) {
+			fprintf(stderr, "error during nfq_bind_pf()\n");
+			exit(1);
+		}
+	}
+
+	w->qh = nfq_create_queue(w->h, w->queue, &cb, w);
+	if (!w->qh) {
+		fprintf(stderr, "error during nfq_create_queue(%d)\n", w->queue);
 		exit(1);
 	}
 
-	if (nfq_bind_pf(h, AF_INET) < 0) {
-		fprintf(stderr, "error during nfq_bind_pf()\n");
+	/* Classification looks at the first bytes only */
+	if (nfq_set_mode(w->qh, NFQNL_COPY_PACKET, copy_range) < 0) {
+		fprintf(stderr, "can't set packet_copy mode\n");
 		exit(1);
 	}
 
-	qh = nfq_create_queue(h,  0, &cb, NULL);
-	if (!qh) {
-		fprintf(stderr, "error during nfq_create_queue()\n");
+	/* GSO packets are queued as they are instead of being segmented */
+	if (gso &&
+	    nfq_set_queue_flags(w->qh, NFQA_CFG_F_GSO, NFQA_CFG_F_GSO) < 0)
+		fprintf(stderr, "queue %d: can't queue GSO packets\n", w->queue);
+
+	if (nfq_set_queue_maxlen(w->qh, queue_maxlen) < 0)
+		fprintf(stderr, "queue %d: can't set maxlen\n", w->queue);
+
+	if (fail_open &&
+	    nfq_set_queue_flags(w->qh, NFQA_CFG_F_FAIL_OPEN,
+				NFQA_CFG_F_FAIL_OPEN) < 0) {
+		fprintf(stderr, "can't set fail-open mode\n");
 		exit(1);
 	}
 
-	if (nfq_set_mode(qh, NFQNL_COPY_PACKET, 0xffff) < 0) {
-		fprintf(stderr, "can't set packet_copy mode\n");
+	/* A full socket drops packets in the kernel, do not report it as an
+	 * error on every recv.
+	 */
+	fd = nfq_fd(w->h);
+	nfnl_rcvbufsiz(nfq_nfnlh(w->h), rcvbuf_size);
+	if (setsockopt(fd, SOL_NETLINK, NETLINK_NO_ENOBUFS, &one, sizeof(one)) < 0)
+		fprintf(stderr, "can't set NETLINK_NO_ENOBUFS\n");
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* From the image if there is one, compiled from the signatures otherwise */
+static struct sig_matcher *load_matcher(void)
+{
+	struct sig_matcher *m;
+	struct sig_set *sigs;
+	unsigned int i;
+
+	if (image_file) {
+		m = sig_map_image(image_file);
+		if (!m)
+			fprintf(stderr, "can't map %s: %s\n", image_file,
+				strerror(errno));
+		return m;
+	}
+
+	sigs = sig_set_new();
+	if (!sigs) {
+		fprintf(stderr, "out of memory\n");
+		return NULL;
+	}
+	if (sig_file) {
+		if (sig_set_load(sigs, sig_file) < 0) {
+			fprintf(stderr, "can't load signatures from %s\n", sig_file);
+			sig_set_free(sigs);
+			return NULL;
+		}
+	} else {
+		for (i = 0; i < sizeof(default_sigs) / sizeof(default_sigs[0]); i++)
+			sig_set_parse(sigs, default_sigs[i]);
+	}
+
+	m = sig_compile(sigs);
+	if (!m)
+		fprintf(stderr, "can't compile signatures\n");
+	sig_set_free(sigs);
+	return m;
+}
+
+static void reload(struct worker *workers, int nqueues)
+{
+	struct sig_matcher *m, *old;
+	double start, swapped;
+	int i;
+
+	start = now();
+	m = load_matcher();
+	if (!m)
+		return;
+
+	old = __atomic_exchange_n(&matcher, m, __ATOMIC_SEQ_CST);
+	swapped = now();
+	for (i = 0; i < nqueues; i++) {
+		while (__atomic_load_n(&workers[i].matcher, __ATOMIC_SEQ_CST) == old)
+			sched_yield();
+	}
+	sig_free(old);
+
+	fprintf(stderr, "signatures %llu loaded in %.3f ms, old ones released "
+		"after %.3f ms\n", (unsigned long long)sig_serial(m),
+		(swapped - start) * 1e3, (now() - swapped) * 1e3);
+}
+
+/* Comma separated L7 marks below 256 */
+static int parse_marks(const char *arg)
+{
+	unsigned long mark;
+	char *end;
+
+	for (;;) {
+		mark = strtoul(arg, &end, 0);
+		if (end == arg || mark > 255)
+			return -1;
+		oob_start[mark / 32] |= 1U << (mark % 32);
+		if (*end == '\0')
+			return 0;
+		if (*end != ',')
+			return -1;
+		arg = end + 1;
+	}
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"usage: %s [options]\n"
+"  -q num    first queue (0)\n"
+"  -n num    number of queues, one thread each (1)\n"
+"  -b num    verdicts per batch (64)\n"
+"  -m num    messages read per syscall (32)\n"
+"  -c bytes  bytes of each packet copied to the daemon (1024)\n"
+"  -g        segment GSO packets before they are queued\n"
+"  -r bytes  socket receive buffer (16M)\n"
+"  -l num    packets waiting in each queue (4096)\n"
+"  -d mask   mark bits of classified connections, 0 to queue them\n"
+"            for their whole life (0x80000000)\n"
+"  -f        accept packets when a queue is full\n"
+"  -s file   signatures, one \"<mark> [^]<pattern>\" per line\n"
+"  -i file   signature image written by sigc, instead of -s\n"
+"  -F num    flows tracked per queue, 0 to classify packets on their\n"
+"            own (65536)\n"
+"  -P num    flows per queue reassembling at the same time (4096)\n"
+"  -A bytes  bytes reassembled in each direction (2048)\n"
+"  -D file   TLS server names and ALPN protocols, one \"<mark> <name>\"\n"
+"            per line\n"
+"  -o marks  release packets at once and send verdicts to the module,\n"
+"            starting the server handshake for these L7 marks (1,2,...)\n"
+"  -z zone   conntrack zone of the connections verdicts are sent for (0)\n"
+"  -v        print classified packets\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	const char *domain_file = NULL;
+	sigset_t signals;
+	cpu_set_t cpus;
+	long ncpus, zone;
+	int first_queue = 0, nqueues = 1;
+	int i, opt, sig;
+
+	while ((opt = getopt(argc, argv, "q:n:b:m:c:gr:l:d:F:P:A:s:i:D:o:z:fv")) != -1) {
+		switch (opt) {
+		case 'q':
+			first_queue = atoi(optarg);
+			break;
+		case 'n':
+			nqueues = atoi(optarg);
+			break;
+		case 'b':
+			batch_max = atoi(optarg);
+			break;
+		case 'm':
+			recv_batch = atoi(optarg);
+			break;
+		case 'c':
+			copy_range = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			gso = 0;
+			break;
+		case 'r':
+			rcvbuf_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			queue_maxlen = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			done_mark = strtoul(optarg, NULL, 0);
+			break;
+		case 'F':
+			max_flows = strtoul(optarg, NULL, 0);
+			break;
+		case 'P':
+			flow_buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			stream_len = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			fail_open = 1;
+			break;
+		case 's':
+			sig_file = optarg;
+			break;
+		case 'i':
+			image_file = optarg;
+			break;
+		case 'D':
+			domain_file = optarg;
+			break;
+		case 'o':
+			if (parse_marks(optarg) < 0)
+				usage(argv[0]);
+			oob = 1;
+			break;
+		case 'z':
+			zone = strtol(optarg, NULL, 0);
+			if (zone < 0 || zone > 0xffff)
+				usage(argv[0]);
+			oob_zone = zone;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nqueues < 1 || batch_max < 1 || recv_batch < 1 ||
+	    copy_range < 1 || copy_range > 0xffff ||
+	    stream_len < 1 || stream_len > 0xffff)
+		usage(argv[0]);
+
+	if (oob && oob_resolve() < 0) {
+		fprintf(stderr, "can't find the %s netlink family, is the module "
+			"loaded?\n", SYNPROXY_DPI_GENL_NAME);
+		exit(1);
+	}
+
+	matcher = load_matcher();
+	if (!matcher)
+		exit(1);
+
+	if (domain_file) {
+		domains = domain_set_new();
+		if (!domains) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		if (domain_set_load(domains, domain_file) < 0) {
+			fprintf(stderr, "can't load domains from %s\n", domain_file);
+			exit(1);
+		}
+	}
+
+	workers = calloc(nqueues, sizeof(*workers));
+	if (!workers) {
+		fprintf(stderr, "out of memory\n");
 		exit(1);
 	}
 
-	fd = nfq_fd(h);
+	/* With --queue-cpu-fanout packets of CPU i go to queue first + i */
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	for (i = 0; i < nqueues; i++) {
+		workers[i].queue = first_queue + i;
+		workers[i].cpu = i % ncpus;
+		worker_init(&workers[i], i == 0);
+	}
+
+	/* Signals are taken by the main thread only */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGHUP);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	for (i = 0; i < nqueues; i++) {
+		if (pthread_create(&workers[i].thread, NULL, worker_run,
+				   &workers[i])) {
+			fprintf(stderr, "can't start worker %d\n", i);
+			exit(1);
+		}
 
-	while ((rv = recv(fd, buf, sizeof(buf), 0)))
-	{
-		nfq_handle_packet(h, buf, rv);
+		CPU_ZERO(&cpus);
+		CPU_SET(workers[i].cpu, &cpus);
+		if (pthread_setaffinity_np(workers[i].thread, sizeof(cpus), &cpus))
+			fprintf(stderr, "can't pin queue %d to cpu %d\n",
+				workers[i].queue, workers[i].cpu);
 	}
 
-	nfq_destroy_queue(qh);
+	/* SIGHUP reloads the signatures */
+	while (!sigwait(&signals, &sig) && sig == SIGHUP)
+		reload(workers, nqueues);
+
+	for (i = 0; i < nqueues; i++)
+		pthread_cancel(workers[i].thread);
+	for (i = 0; i < nqueues; i++) {
+		pthread_join(workers[i].thread, NULL);
+		nfq_destroy_queue(workers[i].qh);
+	}
 
 #ifdef INSANE
-	nfq_unbind_pf(h, AF_INET);
+	nfq_unbind_pf(workers[0].h, AF_INET);
 #endif
 
-	nfq_close(h);
+	for (i = 0; i < nqueues; i++) {
+		nfq_close(workers[i].h);
+		free(workers[i].iov);
+		free(workers[i].msgs);
+		free(workers[i].buf);
+		flow_table_free(workers[i].flows);
+		if (oob) {
+			close(workers[i].genl_fd);
+			free(workers[i].oob_buf);
+		}
+	}
+	free(workers);
+	sig_free(matcher);
+	domain_set_free(domains);
 
 	exit(0);
 }
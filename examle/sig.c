@@ -0,0 +1,691 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIG_X86
+#endif
+
+#include "sig.h"
+
+struct sig {
+	uint8_t *pat;
+	size_t len;
+	uint32_t flags;
+	uint32_t mark;
+};
+
+struct sig_set {
+	struct sig *sigs;
+	unsigned int count;
+	unsigned int size;
+};
+
+#define SIG_ROOT	0	/* start of unanchored signatures */
+#define SIG_DEAD	1	/* no anchored signature can match anymore */
+#define SIG_AROOT	2	/* start of anchored signatures */
+#define SIG_NONE	UINT32_MAX
+
+typedef size_t (*sig_skip_fn)(const struct sig_matcher *m, const uint8_t *data,
+			      size_t i, size_t len);
+
+/* A DFA over byte classes: bytes that appear in no signature share class 0.
+ * next[state * nclasses + class] is the following state, match[state] the
+ * mark of the best signature ending there. While in the unanchored root,
+ * bytes that do not start a signature are skipped by a prefilter: a bitmap
+ * for the scalar kernel, and for the SIMD kernels low and high nibble masks
+ * whose AND is not zero for such a byte (exact with up to 8 distinct sets
+ * of low nibbles, a superset otherwise).
+ */
+struct sig_matcher {
+	uint32_t nstates;
+	uint32_t nclasses;
+	uint8_t cls[256];
+	uint8_t first[32];
+	uint8_t lo[16];
+	uint8_t hi[16];
+	uint32_t *next;
+	uint32_t *match;
+	sig_skip_fn skip;
+	uint64_t serial;
+	void *map;		/* image next and match point into */
+	size_t map_len;
+};
+
+/* Image layout: this header, then next and match, each at an offset
+ * aligned to SIG_IMAGE_ALIGN from the start of the image. Only offsets are
+ * stored so the image can be mapped anywhere. Images are trusted, mapping
+ * one checks the header but not the transitions.
+ */
+#define SIG_IMAGE_MAGIC		"SIGIMAGE"
+#define SIG_IMAGE_VERSION	1
+#define SIG_IMAGE_BYTE_ORDER	0x01020304
+#define SIG_IMAGE_ALIGN		64
+
+struct sig_image {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t serial;
+	uint64_t size;
+	uint32_t nstates;
+	uint32_t nclasses;
+	uint64_t next_off;
+	uint64_t match_off;
+	uint8_t cls[256];
+	uint8_t first[32];
+	uint8_t lo[16];
+	uint8_t hi[16];
+};
+
+struct sig_set *sig_set_new(void)
+{
+	return calloc(1, sizeof(struct sig_set));
+}
+
+void sig_set_free(struct sig_set *set)
+{
+	unsigned int i;
+
+	if (!set)
+		return;
+	for (i = 0; i < set->count; i++)
+		free(set->sigs[i].pat);
+	free(set->sigs);
+	free(set);
+}
+
+unsigned int sig_set_count(const struct sig_set *set)
+{
+	return set->count;
+}
+
+int sig_set_add(struct sig_set *set, const uint8_t *pat, size_t len,
+		uint32_t flags, uint32_t mark)
+{
+	struct sig *sig;
+
+	if (len == 0 || mark == 0)
+		return -EINVAL;
+
+	if (set->count == set->size) {
+		unsigned int size = set->size ? set->size * 2 : 64;
+
+		sig = realloc(set->sigs, size * sizeof(*sig));
+		if (!sig)
+			return -ENOMEM;
+		set->sigs = sig;
+		set->size = size;
+	}
+
+	sig = &set->sigs[set->count];
+	sig->pat = malloc(len);
+	if (!sig->pat)
+		return -ENOMEM;
+	memcpy(sig->pat, pat, len);
+	sig->len = len;
+	sig->flags = flags;
+	sig->mark = mark;
+	set->count++;
+	return 0;
+}
+
+static int hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower(c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
+int sig_set_parse(struct sig_set *set, const char *line)
+{
+	uint32_t flags = 0;
+	unsigned long mark;
+	const char *p;
+	char *end;
+	uint8_t *pat;
+	size_t len = 0;
+	int hi, lo, err;
+
+	mark = strtoul(line, &end, 0);
+	if (end == line || !isspace((unsigned char)*end))
+		return -EINVAL;
+	for (p = end; isspace((unsigned char)*p); p++)
+		;
+	if (*p == '^') {
+		flags |= SIG_F_ANCHORED;
+		p++;
+	}
+
+	pat = malloc(strlen(p) + 1);
+	if (!pat)
+		return -ENOMEM;
+
+	for (; *p && *p != '\n' && *p != '\r'; p++) {
+		if (*p != '\\') {
+			pat[len++] = *p;
+			continue;
+		}
+
+		p++;
+		if (*p == '\\' || *p == '^') {
+			pat[len++] = *p;
+		} else if (*p == 'x' && (hi = hexval(p[1])) >= 0 &&
+			   (lo = hexval(p[2])) >= 0) {
+			pat[len++] = hi << 4 | lo;
+			p += 2;
+		} else {
+			free(pat);
+			return -EINVAL;
+		}
+	}
+
+	err = mark > UINT32_MAX ? -EINVAL :
+	      sig_set_add(set, pat, len, flags, mark);
+	free(pat);
+	return err;
+}
+
+int sig_set_load(struct sig_set *set, const char *path)
+{
+	char line[4096];
+	const char *p;
+	unsigned int n = 0;
+	FILE *f;
+	int err = 0;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -errno;
+
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		for (p = line; isspace((unsigned char)*p); p++)
+			;
+		if (*p == '\0' || *p == '#')
+			continue;
+
+		err = sig_set_parse(set, p);
+		if (err < 0) {
+			fprintf(stderr, "%s:%u: bad signature\n", path, n);
+			break;
+		}
+	}
+
+	fclose(f);
+	return err;
+}
+
+static void sig_prefilter(struct sig_matcher *m)
+{
+	const uint32_t *root = &m->next[SIG_ROOT * m->nclasses];
+	uint16_t lsets[16] = { 0 }, buckets[8];
+	unsigned int nbuckets = 0, b, h, l, c;
+
+	for (c = 0; c < 256; c++) {
+		if (root[m->cls[c]] == SIG_ROOT)
+			continue;
+		m->first[c >> 3] |= 1 << (c & 7);
+		lsets[c >> 4] |= 1 << (c & 15);
+	}
+
+	/* High nibbles with the same set of low nibbles share a bucket, the
+	 * last bucket takes all sets that do not fit.
+	 */
+	for (h = 0; h < 16; h++) {
+		if (!lsets[h])
+			continue;
+		for (b = 0; b < nbuckets; b++) {
+			if (buckets[b] == lsets[h])
+				break;
+		}
+		if (b == nbuckets) {
+			if (nbuckets < 8)
+				buckets[nbuckets++] = lsets[h];
+			else
+				buckets[b = 7] |= lsets[h];
+		}
+		m->hi[h] |= 1 << b;
+	}
+
+	for (b = 0; b < nbuckets; b++) {
+		for (l = 0; l < 16; l++) {
+			if (buckets[b] & (1 << l))
+				m->lo[l] |= 1 << b;
+		}
+	}
+}
+
+static size_t sig_skip_scalar(const struct sig_matcher *m, const uint8_t *data,
+			      size_t i, size_t len)
+{
+	while (i < len && !(m->first[data[i] >> 3] & (1 << (data[i] & 7))))
+		i++;
+	return i;
+}
+
+#ifdef SIG_X86
+__attribute__((target("sse4.2")))
+static size_t sig_skip_sse42(const struct sig_matcher *m, const uint8_t *data,
+			     size_t i, size_t len)
+{
+	const __m128i lo = _mm_loadu_si128((const __m128i *)m->lo);
+	const __m128i hi = _mm_loadu_si128((const __m128i *)m->hi);
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, t;
+	unsigned int bits;
+
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(data + i));
+		t = _mm_and_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+			_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4),
+							   nibble)));
+		bits = ~_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) & 0xffff;
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+
+	return sig_skip_scalar(m, data, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t sig_skip_avx2(const struct sig_matcher *m, const uint8_t *data,
+			    size_t i, size_t len)
+{
+	const __m256i lo = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)m->lo));
+	const __m256i hi = _mm256_broadcastsi128_si256(
+		_mm_loadu_si128((const __m128i *)m->hi));
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i v, t;
+	unsigned int bits;
+
+	for (; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(data + i));
+		t = _mm256_and_si256(
+			_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+			_mm256_shuffle_epi8(hi, _mm256_and_si256(
+					_mm256_srli_epi16(v, 4), nibble)));
+		bits = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(t, zero));
+		if (bits)
+			return i + __builtin_ctz(bits);
+	}
+
+	return sig_skip_sse42(m, data, i, len);
+}
+#endif
+
+int sig_set_kernel(struct sig_matcher *m, enum sig_kernel kernel)
+{
+#ifdef SIG_X86
+	__builtin_cpu_init();
+	if (kernel == SIG_KERNEL_BEST)
+		kernel = __builtin_cpu_supports("avx2") ? SIG_KERNEL_AVX2 :
+			 __builtin_cpu_supports("sse4.2") ? SIG_KERNEL_SSE42 :
+			 SIG_KERNEL_SCALAR;
+
+	switch (kernel) {
+	case SIG_KERNEL_AVX2:
+		if (!__builtin_cpu_supports("avx2"))
+			return -1;
+		m->skip = sig_skip_avx2;
+		return 0;
+	case SIG_KERNEL_SSE42:
+		if (!__builtin_cpu_supports("sse4.2"))
+			return -1;
+		m->skip = sig_skip_sse42;
+		return 0;
+	default:
+		break;
+	}
+#else
+	if (kernel != SIG_KERNEL_SCALAR && kernel != SIG_KERNEL_BEST)
+		return -1;
+#endif
+	m->skip = sig_skip_scalar;
+	return 0;
+}
+
+unsigned int sig_states(const struct sig_matcher *m)
+{
+	return m->nstates;
+}
+
+/* Signatures are numbered in the order they were added, the lowest number
+ * ending in a state gives its mark.
+ */
+static uint32_t sig_insert(struct sig_matcher *m, uint32_t *best, uint32_t root,
+			   const struct sig *sig, uint32_t id)
+{
+	uint32_t s = root, *t;
+	size_t i;
+
+	for (i = 0; i < sig->len; i++) {
+		t = &m->next[s * m->nclasses + m->cls[sig->pat[i]]];
+		if (*t == SIG_NONE)
+			*t = m->nstates++;
+		s = *t;
+	}
+	if (id < best[s])
+		best[s] = id;
+	return s;
+}
+
+struct sig_matcher *sig_compile(const struct sig_set *set)
+{
+	struct sig_matcher *m;
+	uint32_t *best = NULL, *fail = NULL, *queue = NULL;
+	uint32_t max = 3, head = 0, tail = 0, s, v, f, c;
+	unsigned int i;
+	size_t j;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return NULL;
+
+	m->nclasses = 1;
+	for (i = 0; i < set->count; i++) {
+		for (j = 0; j < set->sigs[i].len; j++) {
+			if (!m->cls[set->sigs[i].pat[j]])
+				m->cls[set->sigs[i].pat[j]] = m->nclasses++;
+		}
+		max += set->sigs[i].len;
+	}
+
+	m->next = malloc((size_t)max * m->nclasses * sizeof(*m->next));
+	m->match = calloc(max, sizeof(*m->match));
+	best = malloc(max * sizeof(*best));
+	fail = malloc(max * sizeof(*fail));
+	queue = malloc(max * sizeof(*queue));
+	if (!m->next || !m->match || !best || !fail || !queue)
+		goto err;
+	memset(m->next, 0xff, (size_t)max * m->nclasses * sizeof(*m->next));
+	memset(best, 0xff, max * sizeof(*best));
+
+	m->nstates = 3;
+	for (i = 0; i < set->count; i++)
+		sig_insert(m, best, set->sigs[i].flags & SIG_F_ANCHORED ?
+				    SIG_AROOT : SIG_ROOT, &set->sigs[i], i);
+
+	/* Anchored signatures: a plain trie, missing edges lead to the dead
+	 * state.
+	 */
+	for (c = 0; c < m->nclasses; c++)
+		m->next[SIG_DEAD * m->nclasses + c] = SIG_DEAD;
+	queue[tail++] = SIG_AROOT;
+	while (head < tail) {
+		s = queue[head++];
+		for (c = 0; c < m->nclasses; c++) {
+			v = m->next[s * m->nclasses + c];
+			if (v == SIG_NONE)
+				m->next[s * m->nclasses + c] = SIG_DEAD;
+			else
+				queue[tail++] = v;
+		}
+	}
+
+	/* Unanchored signatures: Aho-Corasick, with the failure links folded
+	 * into the transitions in breadth-first order.
+	 */
+	head = tail = 0;
+	for (c = 0; c < m->nclasses; c++) {
+		v = m->next[SIG_ROOT * m->nclasses + c];
+		if (v == SIG_NONE) {
+			m->next[SIG_ROOT * m->nclasses + c] = SIG_ROOT;
+		} else {
+			fail[v] = SIG_ROOT;
+			queue[tail++] = v;
+		}
+	}
+	while (head < tail) {
+		s = queue[head++];
+		f = fail[s];
+		if (best[f] < best[s])
+			best[s] = best[f];
+		for (c = 0; c < m->nclasses; c++) {
+			v = m->next[s * m->nclasses + c];
+			if (v == SIG_NONE) {
+				m->next[s * m->nclasses + c] =
+					m->next[f * m->nclasses + c];
+			} else {
+				fail[v] = m->next[f * m->nclasses + c];
+				queue[tail++] = v;
+			}
+		}
+	}
+
+	for (s = 0; s < m->nstates; s++) {
+		if (best[s] != SIG_NONE)
+			m->match[s] = set->sigs[best[s]].mark;
+	}
+
+	sig_prefilter(m);
+	sig_set_kernel(m, SIG_KERNEL_BEST);
+
+	free(queue);
+	free(fail);
+	free(best);
+	return m;
+
+err:
+	free(queue);
+	free(fail);
+	free(best);
+	sig_free(m);
+	return NULL;
+}
+
+void sig_free(struct sig_matcher *m)
+{
+	if (!m)
+		return;
+	if (m->map) {
+		munmap(m->map, m->map_len);
+	} else {
+		free(m->next);
+		free(m->match);
+	}
+	free(m);
+}
+
+uint64_t sig_serial(const struct sig_matcher *m)
+{
+	return m->serial;
+}
+
+static uint64_t sig_align(uint64_t off)
+{
+	return (off + SIG_IMAGE_ALIGN - 1) & ~(uint64_t)(SIG_IMAGE_ALIGN - 1);
+}
+
+static int sig_write(int fd, const void *buf, size_t len, uint64_t *off)
+{
+	static const uint8_t zero[SIG_IMAGE_ALIGN];
+	uint64_t pad = sig_align(*off) - *off;
+	ssize_t n;
+
+	if (pad) {
+		if (write(fd, zero, pad) != (ssize_t)pad)
+			return -1;
+		*off += pad;
+	}
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const uint8_t *)buf + n;
+		len -= n;
+		*off += n;
+	}
+	return 0;
+}
+
+int sig_write_image(const struct sig_matcher *m, uint64_t serial,
+		    const char *path)
+{
+	struct sig_image img;
+	size_t next_len = (size_t)m->nstates * m->nclasses * sizeof(*m->next);
+	size_t match_len = (size_t)m->nstates * sizeof(*m->match);
+	char tmp[4096];
+	uint64_t off = 0;
+	int fd, err;
+
+	memset(&img, 0, sizeof(img));
+	memcpy(img.magic, SIG_IMAGE_MAGIC, sizeof(img.magic));
+	img.version = SIG_IMAGE_VERSION;
+	img.byte_order = SIG_IMAGE_BYTE_ORDER;
+	img.serial = serial;
+	img.nstates = m->nstates;
+	img.nclasses = m->nclasses;
+	img.next_off = sig_align(sizeof(img));
+	img.match_off = sig_align(img.next_off + next_len);
+	img.size = img.match_off + match_len;
+	memcpy(img.cls, m->cls, sizeof(img.cls));
+	memcpy(img.first, m->first, sizeof(img.first));
+	memcpy(img.lo, m->lo, sizeof(img.lo));
+	memcpy(img.hi, m->hi, sizeof(img.hi));
+
+	/* Readers map either the old or the new file, never a partial one */
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	if (sig_write(fd, &img, sizeof(img), &off) < 0 ||
+	    sig_write(fd, m->next, next_len, &off) < 0 ||
+	    sig_write(fd, m->match, match_len, &off) < 0 ||
+	    fsync(fd) < 0) {
+		err = -errno;
+		close(fd);
+		unlink(tmp);
+		return err;
+	}
+	close(fd);
+
+	if (rename(tmp, path) < 0) {
+		err = -errno;
+		unlink(tmp);
+		return err;
+	}
+	return 0;
+}
+
+struct sig_matcher *sig_map_image(const char *path)
+{
+	const struct sig_image *img;
+	struct sig_matcher *m;
+	struct stat st;
+	void *map;
+	int fd, c;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return NULL;
+	}
+	if ((size_t)st.st_size < sizeof(*img)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	/* Populated up front, the first packets should not fault */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	img = map;
+	if (memcmp(img->magic, SIG_IMAGE_MAGIC, sizeof(img->magic)) ||
+	    img->version != SIG_IMAGE_VERSION ||
+	    img->byte_order != SIG_IMAGE_BYTE_ORDER ||
+	    img->size != (uint64_t)st.st_size ||
+	    img->nstates < 3 || img->nclasses < 1 || img->nclasses > 256 ||
+	    img->next_off % SIG_IMAGE_ALIGN || img->match_off % SIG_IMAGE_ALIGN ||
+	    img->next_off < sizeof(*img) ||
+	    img->next_off + (uint64_t)img->nstates * img->nclasses *
+	    sizeof(uint32_t) > img->match_off ||
+	    img->match_off + (uint64_t)img->nstates * sizeof(uint32_t) >
+	    img->size)
+		goto err;
+	for (c = 0; c < 256; c++) {
+		if (img->cls[c] >= img->nclasses)
+			goto err;
+	}
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		goto err;
+	m->nstates = img->nstates;
+	m->nclasses = img->nclasses;
+	memcpy(m->cls, img->cls, sizeof(m->cls));
+	memcpy(m->first, img->first, sizeof(m->first));
+	memcpy(m->lo, img->lo, sizeof(m->lo));
+	memcpy(m->hi, img->hi, sizeof(m->hi));
+	m->next = (uint32_t *)((uint8_t *)map + img->next_off);
+	m->match = (uint32_t *)((uint8_t *)map + img->match_off);
+	m->serial = img->serial;
+	m->map = map;
+	m->map_len = st.st_size;
+	sig_set_kernel(m, SIG_KERNEL_BEST);
+	return m;
+
+err:
+	munmap(map, st.st_size);
+	errno = EINVAL;
+	return NULL;
+}
+
+uint32_t sig_match(const struct sig_matcher *m, const uint8_t *data,
+		   size_t len)
+{
+	const uint32_t *next = m->next;
+	uint32_t s, n = m->nclasses;
+	size_t i;
+
+	s = SIG_AROOT;
+	for (i = 0; i < len; i++) {
+		s = next[s * n + m->cls[data[i]]];
+		if (s == SIG_DEAD)
+			break;
+		if (m->match[s])
+			return m->match[s];
+	}
+
+	s = SIG_ROOT;
+	i = 0;
+	while (i < len) {
+		if (s == SIG_ROOT &&
+		    !(m->first[data[i] >> 3] & (1 << (data[i] & 7)))) {
+			i = m->skip(m, data, i + 1, len);
+			if (i == len)
+				break;
+		}
+		s = next[s * n + m->cls[data[i++]]];
+		if (m->match[s])
+			return m->match[s];
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef SIG_H
+#define SIG_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Signatures are byte strings mapped to an L7 mark. Anchored signatures
+ * match at the start of the payload only, the others anywhere in it.
+ */
+#define SIG_F_ANCHORED	0x01
+
+enum sig_kernel {
+	SIG_KERNEL_SCALAR,
+	SIG_KERNEL_SSE42,
+	SIG_KERNEL_AVX2,
+	SIG_KERNEL_BEST,
+};
+
+struct sig_set;
+struct sig_matcher;
+
+struct sig_set *sig_set_new(void);
+void sig_set_free(struct sig_set *set);
+int sig_set_add(struct sig_set *set, const uint8_t *pat, size_t len,
+		uint32_t flags, uint32_t mark);
+/* "<mark> [^]<pattern>", the pattern may contain \xHH, \\ and \^ */
+int sig_set_parse(struct sig_set *set, const char *line);
+/* One signature per line, '#' starts a comment */
+int sig_set_load(struct sig_set *set, const char *path);
+unsigned int sig_set_count(const struct sig_set *set);
+
+/* All signatures are compiled into one automaton, the set can be freed
+ * afterwards.
+ */
+struct sig_matcher *sig_compile(const struct sig_set *set);
+void sig_free(struct sig_matcher *m);
+/* Writes the compiled automaton as an image that sig_map_image() uses in
+ * place. serial is stored in the image to tell versions apart.
+ */
+int sig_write_image(const struct sig_matcher *m, uint64_t serial,
+		    const char *path);
+struct sig_matcher *sig_map_image(const char *path);
+/* 0 unless mapped from an image */
+uint64_t sig_serial(const struct sig_matcher *m);
+/* Returns -1 if the CPU does not support the kernel */
+int sig_set_kernel(struct sig_matcher *m, enum sig_kernel kernel);
+unsigned int sig_states(const struct sig_matcher *m);
+
+/* Mark of the signature that ends first in the payload, the one added first
+ * on a tie. Anchored signatures take precedence. 0 if none matches.
+ */
+uint32_t sig_match(const struct sig_matcher *m, const uint8_t *data,
+		   size_t len);
+
+#endif /* SIG_H */
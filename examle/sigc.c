@@ -0,0 +1,76 @@
+/*
+ * Compiles a signature file into an image for nfq -i. The image replaces
+ * the output file atomically, send nfq SIGHUP to switch to it.
+ *
+ * build: gcc -O2 -o sigc sigc.c sig.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "sig.h"
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+"usage: %s [options] signatures image\n"
+"  -V serial  version stored in the image (seconds since the epoch)\n"
+"  -v         print what was compiled\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct sig_matcher *m;
+	struct sig_set *set;
+	uint64_t serial = time(NULL);
+	int verbose = 0, opt, err;
+
+	while ((opt = getopt(argc, argv, "V:v")) != -1) {
+		switch (opt) {
+		case 'V':
+			serial = strtoull(optarg, NULL, 0);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (argc - optind != 2)
+		usage(argv[0]);
+
+	set = sig_set_new();
+	if (!set) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	if (sig_set_load(set, argv[optind]) < 0) {
+		fprintf(stderr, "can't load signatures from %s\n", argv[optind]);
+		exit(1);
+	}
+
+	m = sig_compile(set);
+	if (!m) {
+		fprintf(stderr, "can't compile signatures\n");
+		exit(1);
+	}
+
+	err = sig_write_image(m, serial, argv[optind + 1]);
+	if (err < 0) {
+		fprintf(stderr, "can't write %s: %s\n", argv[optind + 1],
+			strerror(-err));
+		exit(1);
+	}
+
+	if (verbose)
+		printf("%u signatures, %u states, serial %llu\n",
+		       sig_set_count(set), sig_states(m),
+		       (unsigned long long)serial);
+	sig_set_free(set);
+	sig_free(m);
+	return 0;
+}
@@ -0,0 +1,173 @@
+#include <string.h>
+
+#include "tls.h"
+
+#define TLS_CONTENT_HANDSHAKE	0x16
+#define TLS_CLIENT_HELLO	0x01
+#define TLS_EXT_SNI		0
+#define TLS_EXT_ALPN		16
+#define TLS_SNI_HOST_NAME	0
+
+/* Bounds-checked reader, every access fails once the end is passed */
+struct cursor {
+	const uint8_t *p;
+	const uint8_t *end;
+};
+
+static int get_u8(struct cursor *c, uint32_t *v)
+{
+	if (c->end - c->p < 1)
+		return 0;
+	*v = c->p[0];
+	c->p += 1;
+	return 1;
+}
+
+static int get_u16(struct cursor *c, uint32_t *v)
+{
+	if (c->end - c->p < 2)
+		return 0;
+	*v = c->p[0] << 8 | c->p[1];
+	c->p += 2;
+	return 1;
+}
+
+static int get_u24(struct cursor *c, uint32_t *v)
+{
+	if (c->end - c->p < 3)
+		return 0;
+	*v = c->p[0] << 16 | c->p[1] << 8 | c->p[2];
+	c->p += 3;
+	return 1;
+}
+
+static int skip(struct cursor *c, size_t n)
+{
+	if ((size_t)(c->end - c->p) < n)
+		return 0;
+	c->p += n;
+	return 1;
+}
+
+/* Splits off the next n bytes as a cursor of their own */
+static int sub(struct cursor *c, size_t n, struct cursor *s)
+{
+	if ((size_t)(c->end - c->p) < n)
+		return 0;
+	s->p = c->p;
+	s->end = c->p + n;
+	c->p += n;
+	return 1;
+}
+
+static void parse_sni(struct cursor ext, struct tls_hello *hello)
+{
+	struct cursor list;
+	uint32_t n, type, len;
+
+	if (!get_u16(&ext, &n) || !sub(&ext, n, &list))
+		return;
+
+	while (get_u8(&list, &type) && get_u16(&list, &len)) {
+		if (type == TLS_SNI_HOST_NAME) {
+			if ((size_t)(list.end - list.p) < len)
+				return;
+			hello->sni = list.p;
+			hello->sni_len = len;
+			return;
+		}
+		if (!skip(&list, len))
+			return;
+	}
+}
+
+static void parse_alpn(struct cursor ext, struct tls_hello *hello)
+{
+	uint32_t n;
+
+	if (!get_u16(&ext, &n) || (size_t)(ext.end - ext.p) < n)
+		return;
+	hello->alpn = ext.p;
+	hello->alpn_len = n;
+}
+
+enum tls_res tls_parse_hello(const uint8_t *data, size_t len,
+			     struct tls_hello *hello)
+{
+	struct cursor c = { data, data + len }, ext;
+	uint32_t v, rec_len, hs_len, n, type;
+	int complete;
+
+	memset(hello, 0, sizeof(*hello));
+
+	/* Record header, then the handshake header of a ClientHello */
+	if (!get_u8(&c, &v))
+		return TLS_PARTIAL;
+	if (v != TLS_CONTENT_HANDSHAKE)
+		return TLS_NOT_HELLO;
+	if (!get_u16(&c, &v) || !get_u16(&c, &rec_len))
+		return TLS_PARTIAL;
+	if ((v >> 8) != 3)
+		return TLS_NOT_HELLO;
+	if (!get_u8(&c, &v))
+		return TLS_PARTIAL;
+	if (v != TLS_CLIENT_HELLO)
+		return TLS_NOT_HELLO;
+	if (!get_u24(&c, &hs_len))
+		return TLS_PARTIAL;
+	if (hs_len + 4 > rec_len)
+		return TLS_NOT_HELLO;
+	complete = (size_t)(c.end - c.p) >= hs_len;
+	if (complete)
+		c.end = c.p + hs_len;
+
+	/* Version, random, session id, cipher suites, compression. Running
+	 * out of data is only an error if the whole hello was there.
+	 */
+	if (!skip(&c, 2 + 32) ||
+	    !get_u8(&c, &n) || !skip(&c, n) ||
+	    !get_u16(&c, &n) || !skip(&c, n) ||
+	    !get_u8(&c, &n) || !skip(&c, n))
+		return complete ? TLS_NOT_HELLO : TLS_PARTIAL;
+
+	/* A hello without extensions */
+	if (c.p == c.end)
+		return complete ? TLS_OK : TLS_PARTIAL;
+	if (!get_u16(&c, &n))
+		return complete ? TLS_NOT_HELLO : TLS_PARTIAL;
+
+	while (n >= 4) {
+		if (!get_u16(&c, &type) || !get_u16(&c, &v))
+			return complete ? TLS_NOT_HELLO : TLS_PARTIAL;
+		if (v > n - 4)
+			return TLS_NOT_HELLO;
+		if (!sub(&c, v, &ext))
+			return complete ? TLS_NOT_HELLO : TLS_PARTIAL;
+		n -= 4 + v;
+
+		if (type == TLS_EXT_SNI)
+			parse_sni(ext, hello);
+		else if (type == TLS_EXT_ALPN)
+			parse_alpn(ext, hello);
+	}
+
+	return TLS_OK;
+}
+
+int tls_alpn_next(const struct tls_hello *hello, size_t *off,
+		  const uint8_t **proto, size_t *len)
+{
+	size_t n;
+
+	if (*off >= hello->alpn_len)
+		return 0;
+
+	n = hello->alpn[*off];
+	if (n == 0 || *off + 1 + n > hello->alpn_len)
+		return 0;
+
+	*proto = hello->alpn + *off + 1;
+	*len = n;
+	*off += 1 + n;
+	return 1;
+}
@@ -0,0 +1,33 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum tls_res {
+	TLS_OK,
+	TLS_NOT_HELLO,		/* not the start of a ClientHello */
+	TLS_PARTIAL,		/* the ClientHello goes on past the data */
+};
+
+/* Fields point into the parsed data, lengths are 0 if absent. */
+struct tls_hello {
+	const uint8_t *sni;
+	size_t sni_len;
+	/* ALPN protocol name list, without its length */
+	const uint8_t *alpn;
+	size_t alpn_len;
+};
+
+/* Parses the ClientHello at the start of a TCP payload without copying or
+ * allocating. SNI and ALPN are also returned for TLS_PARTIAL if they were
+ * complete before the data ended.
+ */
+enum tls_res tls_parse_hello(const uint8_t *data, size_t len,
+			     struct tls_hello *hello);
+
+/* Walks the ALPN list, *off starts at 0. Returns 0 at the end. */
+int tls_alpn_next(const struct tls_hello *hello, size_t *off,
+		  const uint8_t **proto, size_t *len);
+
+#endif /* TLS_H */
@@ -1,5 +1,6 @@
 #include <xtables.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 
 struct xt_spstate_mtinfo {
@@ -9,11 +10,26 @@ struct xt_spstate_mtinfo {
 #define XT_SPSTATE_NONE		0
 #define XT_SPSTATE_IN_PROGRESS	1
 #define XT_SPSTATE_FINISH	2
+#define XT_SPSTATE_DONE		3
+
+#define XT_SPSTATE_MARKS_MAX	256
+#define XT_SPSTATE_F_MARKS	0x01
+
+/* Starts with the revision 0 fields */
+struct xt_spstate_mtinfo_v1 {
+	uint8_t state;
+	uint8_t invert;
+	uint8_t flags;
+	uint8_t pad;
+	uint32_t marks[XT_SPSTATE_MARKS_MAX / 32];
+};
 
 enum {
 	O_NONE = 0,
 	O_IN_PROGRESS,
-	O_FINISH
+	O_FINISH,
+	O_DONE,
+	O_L7_MARKS
 };
 
 static void spstate_mt_help(void)
@@ -22,7 +38,8 @@ static void spstate_mt_help(void)
 "spstate match options:\n"
 " --none    Recheck connection by timer expired\n"
 " --finish    Recheck connection by timer expired\n"
-" --in-progress  Check related connection\n");
+" --in-progress  Check related connection\n"
+" --done    DPI is done with the connection\n");
 }
 
 static const struct xt_option_entry spstate_mt_opts[] = {
@@ -32,9 +49,96 @@ static const struct xt_option_entry spstate_mt_opts[] = {
 	 .flags = XTOPT_INVERT},
 	{.name = "in-progress", .id = O_IN_PROGRESS, .type = XTTYPE_NONE,
 	 .flags = XTOPT_INVERT},
+	{.name = "done", .id = O_DONE, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	XTOPT_TABLEEND,
+};
+
+static void spstate_mt_help_v1(void)
+{
+	spstate_mt_help();
+	printf(
+" --l7-marks mark[,mark:mark...]\n"
+"                Packet mark is one of the listed L7 marks (0-255)\n");
+}
+
+static const struct xt_option_entry spstate_mt_opts_v1[] = {
+	{.name = "none", .id = O_NONE, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "finish", .id = O_FINISH, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "in-progress", .id = O_IN_PROGRESS, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "done", .id = O_DONE, .type = XTTYPE_NONE,
+	 .flags = XTOPT_INVERT},
+	{.name = "l7-marks", .id = O_L7_MARKS, .type = XTTYPE_STRING},
 	XTOPT_TABLEEND,
 };
 
+static bool spstate_test_mark(const struct xt_spstate_mtinfo_v1 *info,
+			      unsigned int mark)
+{
+	return info->marks[mark / 32] & (1U << (mark % 32));
+}
+
+static void spstate_print_marks(const struct xt_spstate_mtinfo_v1 *info)
+{
+	const char *sep = " ";
+	unsigned int i, j;
+
+	for (i = 0; i < XT_SPSTATE_MARKS_MAX; i++) {
+		if (!spstate_test_mark(info, i))
+			continue;
+
+		for (j = i; j + 1 < XT_SPSTATE_MARKS_MAX &&
+			    spstate_test_mark(info, j + 1); j++)
+			;
+
+		if (j == i)
+			printf("%s%u", sep, i);
+		else
+			printf("%s%u:%u", sep, i, j);
+		sep = ",";
+		i = j;
+	}
+}
+
+static void spstate_parse_marks(struct xt_spstate_mtinfo_v1 *info,
+				const char *arg)
+{
+	unsigned int from, to;
+	char *buf, *tok, *next, *end;
+
+	buf = strdup(arg);
+	if (buf == NULL)
+		xtables_error(OTHER_PROBLEM, "strdup");
+
+	for (tok = buf; tok != NULL; tok = next) {
+		next = strchr(tok, ',');
+		if (next != NULL)
+			*next++ = '\0';
+
+		if (!xtables_strtoui(tok, &end, &from, 0,
+				     XT_SPSTATE_MARKS_MAX - 1))
+			xtables_param_act(XTF_BAD_VALUE, "spstate",
+					  "--l7-marks", tok);
+		to = from;
+		if (*end == ':' &&
+		    !xtables_strtoui(end + 1, &end, &to, from,
+				     XT_SPSTATE_MARKS_MAX - 1))
+			xtables_param_act(XTF_BAD_VALUE, "spstate",
+					  "--l7-marks", tok);
+		if (*end != '\0')
+			xtables_param_act(XTF_BAD_VALUE, "spstate",
+					  "--l7-marks", tok);
+
+		for (; from <= to; from++)
+			info->marks[from / 32] |= 1U << (from % 32);
+	}
+
+	free(buf);
+}
+
 static void spstate_mt_print(const void *ip, const struct xt_entry_match *match,
                        int numeric)
 {
@@ -53,6 +157,9 @@ static void spstate_mt_print(const void *ip, const struct xt_entry_match *match,
 	case XT_SPSTATE_FINISH:
 		printf(" finish");
 		break;
+	case XT_SPSTATE_DONE:
+		printf(" done");
+		break;
 	}
 }
 
@@ -72,6 +179,9 @@ static void spstate_mt_save(const void *ip, const struct xt_entry_match *match)
 	case XT_SPSTATE_FINISH:
 		printf(" --finish");
 		break;
+	case XT_SPSTATE_DONE:
+		printf(" --done");
+		break;
 	}
 }
 
@@ -92,7 +202,50 @@ static void spstate_mt_parse(struct xt_option_call *cb)
 	case O_FINISH:
 		info->state = XT_SPSTATE_FINISH;
 		break;
+	case O_DONE:
+		info->state = XT_SPSTATE_DONE;
+		break;
+	}
+}
+
+/* The state part of revision 1 is handled by the revision 0 code, the
+ * structures share their first fields.
+ */
+static void spstate_mt_print_v1(const void *ip,
+				const struct xt_entry_match *match, int numeric)
+{
+	const struct xt_spstate_mtinfo_v1 *info = (struct xt_spstate_mtinfo_v1 *)match->data;
+
+	spstate_mt_print(ip, match, numeric);
+	if (info->flags & XT_SPSTATE_F_MARKS) {
+		printf(" l7-marks");
+		spstate_print_marks(info);
+	}
+}
+
+static void spstate_mt_save_v1(const void *ip, const struct xt_entry_match *match)
+{
+	const struct xt_spstate_mtinfo_v1 *info = (struct xt_spstate_mtinfo_v1 *)match->data;
+
+	spstate_mt_save(ip, match);
+	if (info->flags & XT_SPSTATE_F_MARKS) {
+		printf(" --l7-marks");
+		spstate_print_marks(info);
+	}
+}
+
+static void spstate_mt_parse_v1(struct xt_option_call *cb)
+{
+	struct xt_spstate_mtinfo_v1 *info = cb->data;
+
+	if (cb->entry->id != O_L7_MARKS) {
+		spstate_mt_parse(cb);
+		return;
 	}
+
+	xtables_option_parse(cb);
+	spstate_parse_marks(info, cb->arg);
+	info->flags |= XT_SPSTATE_F_MARKS;
 }
 
 static struct xtables_match spstate_mt_reg[] = {
@@ -109,6 +262,19 @@ static struct xtables_match spstate_mt_reg[] = {
 		.x6_parse      = spstate_mt_parse,
 		.x6_options    = spstate_mt_opts,
 	},
+	{
+		.version       = XTABLES_VERSION,
+		.name          = "spstate",
+		.revision      = 1,
+		.family        = NFPROTO_IPV4,
+		.size          = XT_ALIGN(sizeof(struct xt_spstate_mtinfo_v1)),
+		.userspacesize = XT_ALIGN(sizeof(struct xt_spstate_mtinfo_v1)),
+		.help          = spstate_mt_help_v1,
+		.print         = spstate_mt_print_v1,
+		.save          = spstate_mt_save_v1,
+		.x6_parse      = spstate_mt_parse_v1,
+		.x6_options    = spstate_mt_opts_v1,
+	},
 };
 
 void _init(void)
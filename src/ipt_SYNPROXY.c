@@ -8,26 +8,380 @@
 
 #include <linux/module.h>
 #include <linux/skbuff.h>
+#include <linux/hash.h>
+#include <linux/jhash.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <net/tcp.h>
+#include <net/route.h>
+#include <net/xfrm.h>
+#include <net/netns/generic.h>
+#include <net/genetlink.h>
 
 #include <linux/netfilter_ipv4/ip_tables.h>
 #include <linux/netfilter/x_tables.h>
 #include <linux/netfilter/xt_SYNPROXY.h>
+#include <linux/netfilter/ipset/ip_set.h>
 #include <net/netfilter/nf_conntrack.h>
 #include <net/netfilter/nf_conntrack_core.h>
 #include <net/netfilter/nf_conntrack_seqadj.h>
+#include <net/netfilter/nf_conntrack_zones.h>
 #include <net/netfilter/nf_conntrack_synproxy.h>
 
+#define CREATE_TRACE_POINTS
+#include "synproxy_dpi_trace.h"
+
 #define SYNPROXY_IN_PROGRESS 1
 #define SYNPROXY_FINISH 2
+/* The server handshake was started while DPI is in progress */
+#define SYNPROXY_SPECULATIVE 3
+/* ... and completed, the server waits for the verdict */
+#define SYNPROXY_SPECULATIVE_OPEN 4
+
+static bool cookie_only __read_mostly;
+module_param(cookie_only, bool, 0644);
+MODULE_PARM_DESC(cookie_only, "Answer SYNs without keeping state, create the "
+		 "conntrack entry once the client ACK carries a valid cookie");
+
+static bool replay_first_segment __read_mostly;
+module_param(replay_first_segment, bool, 0644);
+MODULE_PARM_DESC(replay_first_segment, "Keep the segment that triggered the DPI "
+		 "verdict and send it to the server once its handshake completes");
+
+static unsigned int stash_max_entries __read_mostly = 4096;
+module_param(stash_max_entries, uint, 0644);
+MODULE_PARM_DESC(stash_max_entries, "Maximum number of stored segments");
+
+static unsigned int stash_max_bytes __read_mostly = 16 << 20;
+module_param(stash_max_bytes, uint, 0644);
+MODULE_PARM_DESC(stash_max_bytes, "Maximum memory used by stored segments");
+
+static unsigned int stash_timeout __read_mostly = 3000;
+module_param(stash_timeout, uint, 0644);
+MODULE_PARM_DESC(stash_timeout, "Time in ms a stored segment waits for the "
+		 "server handshake");
+
+static unsigned int rx_max_bytes __read_mostly;
+module_param(rx_max_bytes, uint, 0644);
+MODULE_PARM_DESC(rx_max_bytes, "Acknowledge and keep up to this many bytes of "
+		 "client data per connection while DPI is in progress (0 = off)");
+
+static unsigned int verdict_cache_size __read_mostly = 4096;
+module_param(verdict_cache_size, uint, 0644);
+MODULE_PARM_DESC(verdict_cache_size, "Maximum number of cached DPI verdicts "
+		 "per network namespace (0 = off)");
+
+static unsigned int verdict_cache_timeout __read_mostly = 300;
+module_param(verdict_cache_timeout, uint, 0644);
+MODULE_PARM_DESC(verdict_cache_timeout, "Time in seconds a cached DPI verdict "
+		 "stays valid");
+
+static unsigned int in_progress_timeout __read_mostly = 30;
+module_param(in_progress_timeout, uint, 0644);
+MODULE_PARM_DESC(in_progress_timeout, "Time in seconds DPI has to decide on a "
+		 "connection before it is removed (0 = conntrack timeouts)");
+
+static unsigned int in_progress_per_source __read_mostly;
+module_param(in_progress_per_source, uint, 0644);
+MODULE_PARM_DESC(in_progress_per_source, "Maximum number of connections in "
+		 "progress per client address (0 = no limit)");
+
+static unsigned int server_syn_rto __read_mostly = 200;
+module_param(server_syn_rto, uint, 0644);
+MODULE_PARM_DESC(server_syn_rto, "Initial time in ms before the SYN to the "
+		 "server is retransmitted, doubled on each retry");
+
+static unsigned int server_syn_retries __read_mostly = 3;
+module_param(server_syn_retries, uint, 0644);
+MODULE_PARM_DESC(server_syn_retries, "Number of SYN retransmissions to the "
+		 "server (0 = left to the client)");
+
+static bool fastpath __read_mostly;
+static const struct kernel_param_ops synproxy_fastpath_param_ops;
+module_param_cb(fastpath, &synproxy_fastpath_param_ops, &fastpath, 0644);
+MODULE_PARM_DESC(fastpath, "Forward established packets of allowed connections "
+		 "without traversing the filter and security FORWARD chains");
+
+static unsigned int dpi_done_mark __read_mostly = 0x80000000;
+module_param(dpi_done_mark, uint, 0644);
+MODULE_PARM_DESC(dpi_done_mark, "Packet mark bits DPI sets once it is done with "
+		 "a connection, they are not part of the L7 mark");
+
+static unsigned int dpi_max_packets __read_mostly = 32;
+module_param(dpi_max_packets, uint, 0644);
+MODULE_PARM_DESC(dpi_max_packets, "Packets of a proxied connection in both "
+		 "directions after which DPI gives up on it (0 = no limit)");
+
+static unsigned int dpi_max_bytes __read_mostly = 16384;
+module_param(dpi_max_bytes, uint, 0644);
+MODULE_PARM_DESC(dpi_max_bytes, "Bytes of a proxied connection in both "
+		 "directions after which DPI gives up on it (0 = no limit)");
+
+struct synproxy_dpi_stats {
+	unsigned int			stash_stored;
+	unsigned int			stash_replayed;
+	unsigned int			stash_evicted;
+	unsigned int			stash_expired;
+	unsigned int			stash_full;
+	unsigned int			verdict_hit;
+	unsigned int			verdict_miss;
+	unsigned int			verdict_stored;
+	unsigned int			verdict_evicted;
+	unsigned int			in_progress_evicted;
+	unsigned int			in_progress_limit;
+	unsigned int			route_hit;
+	unsigned int			route_miss;
+	unsigned int			fastpath;
+	unsigned int			server_syn_retrans;
+	unsigned int			oob_verdict;
+	unsigned int			oob_start;
+	unsigned int			oob_miss;
+};
+
+#define SYNPROXY_VERDICT_BITS	10
+
+/* DPI verdicts of recent connections, keyed by the server address after
+ * DNAT. Lookups are lockless, updates are serialized by the lock.
+ */
+struct synproxy_verdict_cache {
+	spinlock_t			lock;
+	struct hlist_head		hash[1 << SYNPROXY_VERDICT_BITS];
+	struct list_head		lru;
+	unsigned int			count;
+};
+
+#define SYNPROXY_TRUSTED_MAX	8
+
+/* An ipset whose destinations get the server handshake started in parallel
+ * with DPI. Unused slots have an invalid index.
+ */
+struct synproxy_trusted_set {
+	ip_set_id_t			index;
+	atomic_t			hit;
+	atomic_t			abort;
+	char				name[IPSET_MAXNAMELEN];
+};
+
+#define SYNPROXY_INPROG_BITS	8
+
+/* Connections in progress in the order they expire and by their addresses
+ * in FORWARD, and their number per client address. The timer is pending
+ * while the list is not empty.
+ */
+struct synproxy_inprog_table {
+	spinlock_t			lock;
+	struct hlist_head		hash[1 << SYNPROXY_INPROG_BITS];
+	struct hlist_head		conns[1 << SYNPROXY_INPROG_BITS];
+	struct list_head		list;
+	struct timer_list		timer;
+};
+
+#define SYNPROXY_ROUTE_BITS	6
 
-static struct iphdr *
-synproxy_build_ip(struct sk_buff *skb, __be32 saddr, __be32 daddr)
+/* Routes of generated packets, per CPU and keyed by their addresses. The
+ * entries hold a reference, which is dropped when the route is found to be
+ * stale or a device goes away.
+ */
+struct synproxy_route {
+	__be32				saddr;
+	__be32				daddr;
+	struct dst_entry		*dst;
+};
+
+struct synproxy_route_cache {
+	spinlock_t			lock;
+	struct synproxy_route		routes[1 << SYNPROXY_ROUTE_BITS];
+};
+
+/* Handshake and DPI wait times, log2 buckets of microseconds: bucket 0 holds
+ * zero, bucket n holds [2^(n-1), 2^n), the last one everything above.
+ */
+enum synproxy_lat {
+	SYNPROXY_LAT_CLIENT_ACK,	/* SYN to client ACK */
+	SYNPROXY_LAT_VERDICT,		/* client ACK to DPI verdict */
+	SYNPROXY_LAT_SERVER_RTT,	/* server SYN to its SYN/ACK */
+	SYNPROXY_LAT_RETRANS,		/* dropped first segment to its retransmission */
+	SYNPROXY_LAT_MAX
+};
+
+#define SYNPROXY_LAT_BUCKETS	32
+
+struct synproxy_latency {
+	u32				count[SYNPROXY_LAT_MAX][SYNPROXY_LAT_BUCKETS];
+};
+
+/* filter and security: the FORWARD chains after the mangle table */
+#define SYNPROXY_FASTPATH_TABLES 2
+
+struct synproxy_dpi_net {
+	struct synproxy_dpi_stats __percpu	*stats;
+	struct synproxy_latency __percpu	*latency;
+	struct synproxy_route_cache __percpu	*routes;
+	struct synproxy_verdict_cache		verdicts;
+	struct synproxy_inprog_table		inprog;
+	struct synproxy_trusted_set		trusted[SYNPROXY_TRUSTED_MAX];
+	unsigned int				trusted_count;
+	atomic_t				fastpath_gen;
+	unsigned int				fastpath_epoch;
+	const struct xt_table_info		*fastpath_rules[SYNPROXY_FASTPATH_TABLES];
+	struct proc_dir_entry			*proc_dir;
+};
+
+static int synproxy_dpi_net_id;
+
+static inline struct synproxy_dpi_net *synproxy_dpi_pernet(struct net *net)
 {
-	struct iphdr *iph;
+	return net_generic(net, synproxy_dpi_net_id);
+}
+
+/* Proxy state of a connection. Out of tree code cannot register a conntrack
+ * extension of its own, so this lives behind struct nf_conn_synproxy: the
+ * synproxy extension is allocated with the extra room. Timestamps are in
+ * microseconds, zero if the event did not happen.
+ */
+struct synproxy_dpi_ext {
+	u32				state;
+	u32				flags;
+	u32				verdict;
+	u32				tstamp_start;
+	u32				tstamp_verdict;
+	u32				tstamp_server_syn;
+	u32				tstamp_server_synack;
+	u32				tstamp_client_ack;
+	/* First segment seen in progress and the arrival of its retransmission */
+	u32				tstamp_data;
+	u32				tstamp_retrans;
+	u32				data_seq;
+	/* Ruleset generation that last accepted the connection, per direction */
+	u32				fastpath_gen[IP_CT_DIR_MAX];
+	/* First client ACK seen in progress, for a verdict out of band */
+	u32				client_seq;
+	u32				client_ack_seq;
+	__be16				client_window;
+	struct synproxy_options		client_opts;
+	/* Seen in FORWARD until DPI is done, both directions */
+	u32				dpi_packets;
+	u32				dpi_bytes;
+};
+
+/* The server SYN was sent, the synproxy hook handles the connection */
+#define SYNPROXY_F_SERVER	0x01
+/* Counted against the in-progress limit of the client address */
+#define SYNPROXY_F_COUNTED	0x02
+/* The client_* fields hold the first client ACK */
+#define SYNPROXY_F_CLIENT	0x04
+/* DPI is done with the connection: later packets get the verdict as their
+ * mark and spstate --done matches them.
+ */
+#define SYNPROXY_F_DONE		0x08
+/* A copy of the server SYN is on the retransmission wheel */
+#define SYNPROXY_F_RTX		0x10
+
+/* The application DPI identified, without the bits telling the rule set
+ * that DPI is done with the connection.
+ */
+static inline u32 synproxy_l7_mark(const struct sk_buff *skb)
+{
+	return skb->mark & ~dpi_done_mark;
+}
+
+static inline u32 synproxy_dpi_now(void)
+{
+	return (u32)ktime_to_us(ktime_get()) ? : 1;
+}
+
+/* Connections created from the synproxy template carry a plain synproxy
+ * extension, only use the room behind it if no other extension lives there.
+ */
+static struct synproxy_dpi_ext *synproxy_dpi_ext(const struct nf_conn *ct)
+{
+	struct nf_conn_synproxy *synproxy = nfct_synproxy(ct);
+	unsigned int off, end;
+	int i;
+
+	if (synproxy == NULL)
+		return NULL;
+
+	off = (char *)synproxy - (char *)ct->ext;
+	end = off + sizeof(*synproxy) + sizeof(struct synproxy_dpi_ext);
+	if (end > ct->ext->len)
+		return NULL;
+
+	for (i = 0; i < NF_CT_EXT_NUM; i++) {
+		if (ct->ext->offset[i] > off && ct->ext->offset[i] < end)
+			return NULL;
+	}
+
+	return (struct synproxy_dpi_ext *)(synproxy + 1);
+}
+
+static struct synproxy_dpi_ext *synproxy_dpi_ext_add(struct nf_conn *ct)
+{
+	struct nf_conn_synproxy *synproxy;
+
+	synproxy = nf_ct_ext_add_length(ct, NF_CT_EXT_SYNPROXY,
+					sizeof(struct synproxy_dpi_ext),
+					GFP_ATOMIC);
+	if (synproxy == NULL)
+		return NULL;
+
+	return (struct synproxy_dpi_ext *)(synproxy + 1);
+}
+
+static inline u32 synproxy_state(const struct synproxy_dpi_ext *dext)
+{
+	return dext ? READ_ONCE(dext->state) : 0;
+}
+
+static inline bool synproxy_is_speculative(u32 state)
+{
+	return state == SYNPROXY_SPECULATIVE ||
+	       state == SYNPROXY_SPECULATIVE_OPEN;
+}
+
+/* Account the time between two timestamps, nothing if the first event was
+ * not seen.
+ */
+static void synproxy_latency_add(struct net *net, enum synproxy_lat lat,
+				 u32 from, u32 to)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	u32 delta = to - from;
+	unsigned int bucket = 0;
+
+	if (from == 0)
+		return;
+
+	if (delta)
+		bucket = min_t(unsigned int, ilog2(delta) + 1,
+			       SYNPROXY_LAT_BUCKETS - 1);
+	this_cpu_inc(dnet->latency->count[lat][bucket]);
+}
+
+/* Header templates of the packets generated on this CPU: the IP header and
+ * the encoded options of the last option set, only the timestamp values
+ * change between packets of the same rule.
+ */
+struct synproxy_hdr_tmpl {
+	struct iphdr			iph;
+	u32				options;
+	u16				mss;
+	u8				wscale;
+	u8				optlen;
+	__be32				opt[MAX_TCP_OPTION_SPACE / 4];
+};
+
+static DEFINE_PER_CPU(struct synproxy_hdr_tmpl, synproxy_hdr_tmpl);
+
+#define SYNPROXY_OPT_ENCODED	(XT_SYNPROXY_OPT_MSS | \
+				 XT_SYNPROXY_OPT_WSCALE | \
+				 XT_SYNPROXY_OPT_SACK_PERM | \
+				 XT_SYNPROXY_OPT_TIMESTAMP)
+
+static void synproxy_hdr_tmpl_ip(struct synproxy_hdr_tmpl *tmpl)
+{
+	struct iphdr *iph = &tmpl->iph;
 
-	skb_reset_network_header(skb);
-	iph = (struct iphdr *)skb_put(skb, sizeof(*iph));
 	iph->version	= 4;
 	iph->ihl	= sizeof(*iph) / 4;
 	iph->tos	= 0;
@@ -36,10 +390,212 @@ synproxy_build_ip(struct sk_buff *skb, __be32 saddr, __be32 daddr)
 	iph->ttl	= sysctl_ip_default_ttl;
 	iph->protocol	= IPPROTO_TCP;
 	iph->check	= 0;
-	iph->saddr	= saddr;
-	iph->daddr	= daddr;
+}
+
+static void synproxy_hdr_tmpl_options(struct synproxy_hdr_tmpl *tmpl,
+				      const struct synproxy_options *opts,
+				      u32 options)
+{
+	struct {
+		struct tcphdr	th;
+		__be32		opt[MAX_TCP_OPTION_SPACE / 4];
+	} buf;
+	struct synproxy_options key = *opts;
+
+	key.options = options;
+	synproxy_build_options(&buf.th, &key);
+
+	tmpl->options	= options;
+	tmpl->mss	= opts->mss;
+	tmpl->wscale	= opts->wscale;
+	tmpl->optlen	= synproxy_options_size(&key);
+	memcpy(tmpl->opt, buf.opt, tmpl->optlen);
+}
+
+/* Allocate a packet from @saddr to @daddr with room for a TCP header and
+ * @opts, which may be NULL. The IP header and the options are filled in,
+ * the rest of the TCP header is left to the caller.
+ */
+static struct sk_buff *
+synproxy_alloc_tcp(__be32 saddr, __be32 daddr,
+		   const struct synproxy_options *opts, struct iphdr **niph,
+		   struct tcphdr **nth, unsigned int *tcp_hdr_size)
+{
+	struct synproxy_hdr_tmpl *tmpl;
+	struct sk_buff *nskb;
+	__be32 *ts;
+	u32 options = opts ? opts->options & SYNPROXY_OPT_ENCODED : 0;
+
+	tmpl = get_cpu_ptr(&synproxy_hdr_tmpl);
+	if (options &&
+	    (options != tmpl->options ||
+	     ((options & XT_SYNPROXY_OPT_MSS) && opts->mss != tmpl->mss) ||
+	     ((options & XT_SYNPROXY_OPT_WSCALE) && opts->wscale != tmpl->wscale)))
+		synproxy_hdr_tmpl_options(tmpl, opts, options);
+
+	*tcp_hdr_size = sizeof(struct tcphdr) + (options ? tmpl->optlen : 0);
+	nskb = alloc_skb(sizeof(struct iphdr) + *tcp_hdr_size + MAX_TCP_HEADER,
+			 GFP_ATOMIC);
+	if (nskb == NULL)
+		goto out;
+	skb_reserve(nskb, MAX_TCP_HEADER);
+
+	if (tmpl->iph.ttl != sysctl_ip_default_ttl)
+		synproxy_hdr_tmpl_ip(tmpl);
+
+	skb_reset_network_header(nskb);
+	*niph = (struct iphdr *)skb_put(nskb, sizeof(struct iphdr));
+	memcpy(*niph, &tmpl->iph, sizeof(struct iphdr));
+	(*niph)->saddr	= saddr;
+	(*niph)->daddr	= daddr;
+
+	skb_reset_transport_header(nskb);
+	*nth = (struct tcphdr *)skb_put(nskb, *tcp_hdr_size);
+	if (!options)
+		goto out;
+
+	memcpy(*nth + 1, tmpl->opt, tmpl->optlen);
+	/* The timestamps follow the MSS and the timestamp option header, see
+	 * synproxy_build_options().
+	 */
+	if (options & XT_SYNPROXY_OPT_TIMESTAMP) {
+		ts = (__be32 *)(*nth + 1) + (options & XT_SYNPROXY_OPT_MSS ? 2 : 1);
+		ts[0] = htonl(opts->tsval);
+		ts[1] = htonl(opts->tsecr);
+	}
+out:
+	put_cpu_ptr(&synproxy_hdr_tmpl);
+	return nskb;
+}
+
+static u32 synproxy_route_seed __read_mostly;
+
+/* Route a packet generated without a packet to answer, a retransmission or
+ * a handshake started from a verdict out of band.
+ */
+static int synproxy_route_output(struct net *net, struct sk_buff *nskb)
+{
+	const struct iphdr *iph = ip_hdr(nskb);
+	struct flowi4 fl4 = {
+		.daddr		= iph->daddr,
+		.saddr		= iph->saddr,
+		.flowi4_tos	= RT_TOS(iph->tos),
+		.flowi4_mark	= nskb->mark,
+		.flowi4_flags	= FLOWI_FLAG_ANYSRC,
+	};
+	struct dst_entry *dst;
+	struct rtable *rt;
 
-	return iph;
+	rt = ip_route_output_key(net, &fl4);
+	if (IS_ERR(rt))
+		return PTR_ERR(rt);
+
+	dst = xfrm_lookup(net, &rt->dst, flowi4_to_flowi(&fl4), NULL, 0);
+	if (IS_ERR(dst))
+		return PTR_ERR(dst);
+
+	skb_dst_set(nskb, dst);
+	return 0;
+}
+
+/* Route a generated packet as ip_route_me_harder() does, reusing the route
+ * of the last packet between the same addresses while it is valid. Routes
+ * through an xfrm bundle are not cached. A miss starts from the route of
+ * @skb, the packet answered, which keeps an l3mdev binding.
+ */
+static int synproxy_route(struct net *net, const struct sk_buff *skb,
+			  struct sk_buff *nskb)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	const struct iphdr *iph = ip_hdr(nskb);
+	struct synproxy_route_cache *cache;
+	struct synproxy_route *route;
+	struct dst_entry *dst = NULL, *old;
+	unsigned int hh_len;
+	int err;
+
+	cache = raw_cpu_ptr(dnet->routes);
+	route = &cache->routes[jhash_2words((__force u32)iph->saddr,
+					    (__force u32)iph->daddr,
+					    synproxy_route_seed) &
+			       ((1 << SYNPROXY_ROUTE_BITS) - 1)];
+
+	spin_lock_bh(&cache->lock);
+	if (route->dst != NULL &&
+	    route->saddr == iph->saddr && route->daddr == iph->daddr) {
+		dst = dst_check(route->dst, 0);
+		if (dst != NULL) {
+			dst_hold(dst);
+		} else {
+			dst_release(route->dst);
+			route->dst = NULL;
+		}
+	}
+	spin_unlock_bh(&cache->lock);
+
+	if (dst != NULL) {
+		this_cpu_inc(dnet->stats->route_hit);
+		skb_dst_set(nskb, dst);
+		goto headroom;
+	}
+
+	this_cpu_inc(dnet->stats->route_miss);
+	if (skb != NULL && skb_dst(skb) != NULL) {
+		skb_dst_set_noref(nskb, skb_dst(skb));
+		err = ip_route_me_harder(net, nskb, RTN_UNSPEC);
+	} else {
+		err = synproxy_route_output(net, nskb);
+	}
+	if (err)
+		return err;
+
+	dst = skb_dst(nskb);
+	if (dst_xfrm(dst) != NULL)
+		goto headroom;
+
+	spin_lock_bh(&cache->lock);
+	old = route->dst;
+	route->saddr = iph->saddr;
+	route->daddr = iph->daddr;
+	route->dst = dst_clone(dst);
+	spin_unlock_bh(&cache->lock);
+
+	if (old != NULL)
+		dst_release(old);
+headroom:
+	hh_len = dst->dev->hard_header_len;
+	if (skb_headroom(nskb) < hh_len &&
+	    pskb_expand_head(nskb, HH_DATA_ALIGN(hh_len - skb_headroom(nskb)),
+			     0, GFP_ATOMIC))
+		return -ENOMEM;
+	return 0;
+}
+
+static void synproxy_route_flush(struct synproxy_dpi_net *dnet)
+{
+	struct synproxy_route_cache *cache;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		cache = per_cpu_ptr(dnet->routes, cpu);
+
+		spin_lock_bh(&cache->lock);
+		for (i = 0; i < ARRAY_SIZE(cache->routes); i++) {
+			if (cache->routes[i].dst == NULL)
+				continue;
+			dst_release(cache->routes[i].dst);
+			cache->routes[i].dst = NULL;
+		}
+		spin_unlock_bh(&cache->lock);
+	}
+}
+
+static void synproxy_route_init(struct synproxy_dpi_net *dnet)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		spin_lock_init(&per_cpu_ptr(dnet->routes, cpu)->lock);
 }
 
 static void
@@ -56,9 +612,8 @@ synproxy_send_tcp(const struct synproxy_net *snet,
 	nskb->csum_start  = (unsigned char *)nth - nskb->head;
 	nskb->csum_offset = offsetof(struct tcphdr, check);
 
-	skb_dst_set_noref(nskb, skb_dst(skb));
 	nskb->protocol = htons(ETH_P_IP);
-	if (ip_route_me_harder(net, nskb, RTN_UNSPEC))
+	if (synproxy_route(net, skb, nskb))
 		goto free_nskb;
 
 	if (nfct) {
@@ -74,62 +629,259 @@ free_nskb:
 	kfree_skb(nskb);
 }
 
+/* Cookies are computed over the addresses of the original direction, so the
+ * SYN and the ACK carrying the cookie agree whether or not NAT has already
+ * mangled the packet or a conntrack entry exists yet.
+ */
+static const struct iphdr *
+synproxy_cookie_iph(const struct sk_buff *skb, struct iphdr *_iph)
+{
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL)
+		return ip_hdr(skb);
+
+	*_iph = *ip_hdr(skb);
+	_iph->saddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+	_iph->daddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip;
+	return _iph;
+}
+
 static void
 synproxy_send_client_synack(const struct synproxy_net *snet,
-			    struct sk_buff *skb, const struct tcphdr *th,
+			    const struct sk_buff *skb, const struct tcphdr *th,
 			    const struct synproxy_options *opts)
 {
 	struct sk_buff *nskb;
-	struct iphdr *iph, *niph;
+	struct iphdr *iph, *niph, _iph;
 	struct tcphdr *nth;
 	unsigned int tcp_hdr_size;
 	u16 mss = opts->mss;
-	__be32 saddr, daddr;
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
 
 	iph = ip_hdr(skb);
-	pr_debug("DBGSYN send synack %pI4 -> %pI4, mss %d\n", &iph->daddr, &iph->saddr, mss);
-
-	ct = nf_ct_get(skb, &ctinfo);
-
-	tcp_hdr_size = sizeof(*nth) + synproxy_options_size(opts);
-	nskb = alloc_skb(sizeof(*niph) + tcp_hdr_size + MAX_TCP_HEADER,
-			 GFP_ATOMIC);
+	nskb = synproxy_alloc_tcp(iph->daddr, iph->saddr, opts, &niph, &nth,
+				  &tcp_hdr_size);
 	if (nskb == NULL)
 		return;
-	skb_reserve(nskb, MAX_TCP_HEADER);
-
-	niph = synproxy_build_ip(nskb, iph->daddr, iph->saddr);
 
-	skb_reset_transport_header(nskb);
-	nth = (struct tcphdr *)skb_put(nskb, tcp_hdr_size);
 	nth->source	= th->dest;
 	nth->dest	= th->source;
-	saddr = iph->saddr;
-	daddr = iph->daddr;
-	if (ct) {
-		iph->saddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
-		iph->daddr = ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.dst.u3.ip;
-	}
-	nth->seq	= htonl(__cookie_v4_init_sequence(iph, th, &mss));
-	iph->saddr = saddr;
-	iph->daddr = daddr;
+	nth->seq	= htonl(__cookie_v4_init_sequence(synproxy_cookie_iph(skb, &_iph),
+							  th, &mss));
 	nth->ack_seq	= htonl(ntohl(th->seq) + 1);
 	tcp_flag_word(nth) = TCP_FLAG_SYN | TCP_FLAG_ACK;
 	if (opts->options & XT_SYNPROXY_OPT_ECN)
 		tcp_flag_word(nth) |= TCP_FLAG_ECE;
 	nth->doff	= tcp_hdr_size / 4;
-	nth->window	= 1;
+	/* Let the client send what the proxy is willing to receive while
+	 * DPI is in progress.
+	 */
+	if (rx_max_bytes)
+		nth->window = htons(min_t(unsigned int, rx_max_bytes, 0xffff));
+	else
+		nth->window = 1;
 	nth->check	= 0;
 	nth->urg_ptr	= 0;
 
-	synproxy_build_options(nth, opts);
-
+	trace_synproxy_synack_send(niph, nth);
 	synproxy_send_tcp(snet, skb, nskb, NULL, IP_CT_ESTABLISHED_REPLY,
 			  niph, nth, tcp_hdr_size);
 }
 
+#define SYNPROXY_RTX_SLOTS	64
+#define SYNPROXY_RTX_TICK	(HZ / 100 ? : 1)
+
+/* Server SYNs waiting for a SYN/ACK, hashed by expiry tick into a wheel.
+ * A single timer runs one tick at a time while the wheel is not empty.
+ */
+struct synproxy_rtx {
+	struct hlist_node		node;
+	struct nf_conn			*ct;
+	struct sk_buff			*skb;
+	unsigned long			expires;
+	unsigned int			rto;
+	unsigned int			retries;
+};
+
+static struct {
+	spinlock_t			lock;
+	struct hlist_head		slots[SYNPROXY_RTX_SLOTS];
+	unsigned long			next;
+	unsigned int			count;
+	struct timer_list		timer;
+} synproxy_rtx_wheel;
+
+static inline unsigned long synproxy_rtx_tick(unsigned long time)
+{
+	return time / SYNPROXY_RTX_TICK;
+}
+
+/* Called with the wheel lock held */
+static void synproxy_rtx_insert(struct synproxy_rtx *rtx)
+{
+	unsigned long tick = synproxy_rtx_tick(rtx->expires);
+
+	if (synproxy_rtx_wheel.count++ == 0) {
+		synproxy_rtx_wheel.next = synproxy_rtx_tick(jiffies);
+		mod_timer(&synproxy_rtx_wheel.timer,
+			  (synproxy_rtx_wheel.next + 1) * SYNPROXY_RTX_TICK);
+	}
+	/* Slots behind the wheel are only looked at again a round later */
+	if (time_before(tick, synproxy_rtx_wheel.next))
+		tick = synproxy_rtx_wheel.next;
+	hlist_add_head(&rtx->node,
+		       &synproxy_rtx_wheel.slots[tick % SYNPROXY_RTX_SLOTS]);
+}
+
+static void synproxy_rtx_free(struct synproxy_rtx *rtx)
+{
+	kfree_skb(rtx->skb);
+	nf_ct_put(rtx->ct);
+	kfree(rtx);
+}
+
+/* Keep a copy of the SYN that opens the server half of @ct until the server
+ * answered or the retries are used up.
+ */
+static void synproxy_rtx_add(struct nf_conn *ct, const struct sk_buff *nskb)
+{
+	struct synproxy_rtx *rtx;
+
+	if (!server_syn_retries || !server_syn_rto)
+		return;
+
+	rtx = kmalloc(sizeof(*rtx), GFP_ATOMIC);
+	if (rtx == NULL)
+		return;
+
+	rtx->skb = skb_copy(nskb, GFP_ATOMIC);
+	if (rtx->skb == NULL) {
+		kfree(rtx);
+		return;
+	}
+
+	nf_conntrack_get(&ct->ct_general);
+	rtx->ct = ct;
+	rtx->rto = msecs_to_jiffies(server_syn_rto) ? : 1;
+	rtx->expires = jiffies + rtx->rto;
+	rtx->retries = 0;
+
+	spin_lock_bh(&synproxy_rtx_wheel.lock);
+	synproxy_rtx_insert(rtx);
+	spin_unlock_bh(&synproxy_rtx_wheel.lock);
+}
+
+/* Returns true if the SYN was sent again and @rtx is still needed. */
+static bool synproxy_rtx_send(struct synproxy_rtx *rtx)
+{
+	struct nf_conn *ct = rtx->ct;
+	struct synproxy_net *snet = synproxy_pernet(nf_ct_net(ct));
+	struct sk_buff *nskb;
+
+	if (nf_ct_is_dying(ct) ||
+	    READ_ONCE(ct->proto.tcp.state) != TCP_CONNTRACK_SYN_SENT ||
+	    rtx->retries >= server_syn_retries)
+		return false;
+
+	nskb = skb_copy(rtx->skb, GFP_ATOMIC);
+	if (nskb == NULL)
+		return false;
+
+	this_cpu_inc(synproxy_dpi_pernet(nf_ct_net(ct))->stats->server_syn_retrans);
+	synproxy_send_tcp(snet, NULL, nskb, NULL, IP_CT_NEW, ip_hdr(nskb),
+			  tcp_hdr(nskb), tcp_hdrlen(nskb));
+
+	rtx->retries++;
+	rtx->rto <<= 1;
+	rtx->expires = jiffies + rtx->rto;
+	return true;
+}
+
+static void synproxy_rtx_timer(unsigned long data)
+{
+	struct synproxy_rtx *rtx;
+	struct hlist_node *next;
+	unsigned long now = synproxy_rtx_tick(jiffies);
+	unsigned int i;
+	HLIST_HEAD(expired);
+
+	spin_lock_bh(&synproxy_rtx_wheel.lock);
+	for (i = 0; i < SYNPROXY_RTX_SLOTS &&
+		    !time_after(synproxy_rtx_wheel.next, now); i++) {
+		hlist_for_each_entry_safe(rtx, next,
+					  &synproxy_rtx_wheel.slots[synproxy_rtx_wheel.next %
+								    SYNPROXY_RTX_SLOTS],
+					  node) {
+			if (time_before(jiffies, rtx->expires))
+				continue;
+			hlist_del(&rtx->node);
+			hlist_add_head(&rtx->node, &expired);
+			synproxy_rtx_wheel.count--;
+		}
+		synproxy_rtx_wheel.next++;
+	}
+	/* Fell behind by more than a round, every slot was looked at. */
+	if (time_before(synproxy_rtx_wheel.next, now))
+		synproxy_rtx_wheel.next = now;
+	spin_unlock_bh(&synproxy_rtx_wheel.lock);
+
+	hlist_for_each_entry_safe(rtx, next, &expired, node) {
+		hlist_del(&rtx->node);
+		if (!synproxy_rtx_send(rtx)) {
+			synproxy_rtx_free(rtx);
+			continue;
+		}
+
+		spin_lock_bh(&synproxy_rtx_wheel.lock);
+		synproxy_rtx_insert(rtx);
+		spin_unlock_bh(&synproxy_rtx_wheel.lock);
+	}
+
+	spin_lock_bh(&synproxy_rtx_wheel.lock);
+	if (synproxy_rtx_wheel.count)
+		mod_timer(&synproxy_rtx_wheel.timer,
+			  synproxy_rtx_wheel.next * SYNPROXY_RTX_TICK);
+	spin_unlock_bh(&synproxy_rtx_wheel.lock);
+}
+
+/* Drop the pending SYNs of @net, or all of them if @net is NULL. */
+static void synproxy_rtx_flush(struct net *net)
+{
+	struct synproxy_rtx *rtx;
+	struct hlist_node *next;
+	HLIST_HEAD(flushed);
+	unsigned int i;
+
+	spin_lock_bh(&synproxy_rtx_wheel.lock);
+	for (i = 0; i < SYNPROXY_RTX_SLOTS; i++) {
+		hlist_for_each_entry_safe(rtx, next, &synproxy_rtx_wheel.slots[i],
+					  node) {
+			if (net != NULL && !net_eq(nf_ct_net(rtx->ct), net))
+				continue;
+			hlist_del(&rtx->node);
+			hlist_add_head(&rtx->node, &flushed);
+			synproxy_rtx_wheel.count--;
+		}
+	}
+	spin_unlock_bh(&synproxy_rtx_wheel.lock);
+
+	hlist_for_each_entry_safe(rtx, next, &flushed, node)
+		synproxy_rtx_free(rtx);
+}
+
+static void synproxy_rtx_init(void)
+{
+	unsigned int i;
+
+	spin_lock_init(&synproxy_rtx_wheel.lock);
+	for (i = 0; i < SYNPROXY_RTX_SLOTS; i++)
+		INIT_HLIST_HEAD(&synproxy_rtx_wheel.slots[i]);
+	synproxy_rtx_wheel.count = 0;
+	setup_timer(&synproxy_rtx_wheel.timer, synproxy_rtx_timer, 0);
+}
+
 static void
 synproxy_send_server_syn(const struct synproxy_net *snet,
 			 const struct sk_buff *skb, const struct tcphdr *th,
@@ -141,22 +893,17 @@ synproxy_send_server_syn(const struct synproxy_net *snet,
 	unsigned int tcp_hdr_size;
 	enum ip_conntrack_info ctinfo;
 	struct nf_conn *ct;
+	struct synproxy_dpi_ext *dext;
 	struct nf_conntrack *tmpl = &snet->tmpl->ct_general;
+	bool rtx = false;
 
 	iph = ip_hdr(skb);
 
-	tcp_hdr_size = sizeof(*nth) + synproxy_options_size(opts);
-	nskb = alloc_skb(sizeof(*niph) + tcp_hdr_size + MAX_TCP_HEADER,
-			 GFP_ATOMIC);
+	nskb = synproxy_alloc_tcp(iph->saddr, iph->daddr, opts, &niph, &nth,
+				  &tcp_hdr_size);
 	if (nskb == NULL)
 		return;
 
-	skb_reserve(nskb, MAX_TCP_HEADER);
-
-	niph = synproxy_build_ip(nskb, iph->saddr, iph->daddr);
-
-	skb_reset_transport_header(nskb);
-	nth = (struct tcphdr *)skb_put(nskb, tcp_hdr_size);
 	nth->source	= th->source;
 	nth->dest	= th->dest;
 	nth->seq	= htonl(recv_seq - 1);
@@ -172,8 +919,6 @@ synproxy_send_server_syn(const struct synproxy_net *snet,
 	nth->check	= 0;
 	nth->urg_ptr	= 0;
 
-	synproxy_build_options(nth, opts);
-
 
 	ct = nf_ct_get(skb, &ctinfo);
 	if (ct) {
@@ -189,19 +934,36 @@ synproxy_send_server_syn(const struct synproxy_net *snet,
 			goto err;
 		}
 
-		if (!nfct_seqadj_ext_add(ct)) {
+		/* Connections that went through the in-progress state got
+		 * both extensions before they were confirmed. Adding one to a
+		 * confirmed entry may move the others while they are in use.
+		 */
+		if (!nfct_seqadj(ct) && !nfct_seqadj_ext_add(ct)) {
 			goto err;
 		}
-		if (!nfct_synproxy_ext_add(ct)) {
+		if (!nfct_synproxy(ct) && !synproxy_dpi_ext_add(ct)) {
 			goto err;
 		}
 
+		dext = synproxy_dpi_ext(ct);
+		if (dext) {
+			/* A cookie retransmission or a repeated client ACK
+			 * sends the SYN again, it is kept only once.
+			 */
+			rtx = !(dext->flags & SYNPROXY_F_RTX);
+			dext->flags |= SYNPROXY_F_SERVER | SYNPROXY_F_RTX;
+			dext->tstamp_server_syn = synproxy_dpi_now();
+		}
+
 		spin_unlock_bh(&ct->lock);
 
+		if (rtx)
+			synproxy_rtx_add(ct, nskb);
 		tmpl = NULL;
 	}
 
 out:
+	trace_synproxy_server_syn_send(niph, nth);
 	synproxy_send_tcp(snet, skb, nskb, tmpl, IP_CT_NEW,
 			  niph, nth, tcp_hdr_size);
 	return;
@@ -224,17 +986,11 @@ synproxy_send_server_ack(const struct synproxy_net *snet,
 
 	iph = ip_hdr(skb);
 
-	tcp_hdr_size = sizeof(*nth) + synproxy_options_size(opts);
-	nskb = alloc_skb(sizeof(*niph) + tcp_hdr_size + MAX_TCP_HEADER,
-			 GFP_ATOMIC);
+	nskb = synproxy_alloc_tcp(iph->daddr, iph->saddr, opts, &niph, &nth,
+				  &tcp_hdr_size);
 	if (nskb == NULL)
 		return;
-	skb_reserve(nskb, MAX_TCP_HEADER);
 
-	niph = synproxy_build_ip(nskb, iph->daddr, iph->saddr);
-
-	skb_reset_transport_header(nskb);
-	nth = (struct tcphdr *)skb_put(nskb, tcp_hdr_size);
 	nth->source	= th->dest;
 	nth->dest	= th->source;
 	nth->seq	= htonl(ntohl(th->ack_seq));
@@ -245,8 +1001,6 @@ synproxy_send_server_ack(const struct synproxy_net *snet,
 	nth->check	= 0;
 	nth->urg_ptr	= 0;
 
-	synproxy_build_options(nth, opts);
-
 	synproxy_send_tcp(snet, skb, nskb, NULL, 0, niph, nth, tcp_hdr_size);
 }
 
@@ -262,17 +1016,11 @@ synproxy_send_client_ack(const struct synproxy_net *snet,
 
 	iph = ip_hdr(skb);
 
-	tcp_hdr_size = sizeof(*nth) + synproxy_options_size(opts);
-	nskb = alloc_skb(sizeof(*niph) + tcp_hdr_size + MAX_TCP_HEADER,
-			 GFP_ATOMIC);
+	nskb = synproxy_alloc_tcp(iph->saddr, iph->daddr, opts, &niph, &nth,
+				  &tcp_hdr_size);
 	if (nskb == NULL)
 		return;
-	skb_reserve(nskb, MAX_TCP_HEADER);
-
-	niph = synproxy_build_ip(nskb, iph->saddr, iph->daddr);
 
-	skb_reset_transport_header(nskb);
-	nth = (struct tcphdr *)skb_put(nskb, tcp_hdr_size);
 	nth->source	= th->source;
 	nth->dest	= th->dest;
 	nth->seq	= htonl(ntohl(th->seq) + 1);
@@ -283,20 +1031,117 @@ synproxy_send_client_ack(const struct synproxy_net *snet,
 	nth->check	= 0;
 	nth->urg_ptr	= 0;
 
-	synproxy_build_options(nth, opts);
-
 	synproxy_send_tcp(snet, skb, nskb, skb->nfct, IP_CT_ESTABLISHED_REPLY,
 			  niph, nth, tcp_hdr_size);
 }
 
+/* Acknowledge client data on behalf of the server, the connection is
+ * described by the original direction of @ct since NAT already applied.
+ */
+static void
+synproxy_send_client_data_ack(const struct synproxy_net *snet,
+			      const struct sk_buff *skb, struct nf_conn *ct,
+			      u32 seq, u32 ack_seq, u16 window,
+			      const struct synproxy_options *opts)
+{
+	const struct nf_conntrack_tuple *tuple;
+	const struct nf_conn_synproxy *synproxy;
+	const struct nf_conn_seqadj *seqadj;
+	struct synproxy_options nopts = *opts;
+	struct sk_buff *nskb;
+	struct iphdr *niph;
+	struct tcphdr *nth;
+	unsigned int tcp_hdr_size;
+
+	tuple = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+	/* Once the server handshake completed, packets towards the client
+	 * get the sequence number and timestamp translation, which must not
+	 * apply to values already taken from the client's view.
+	 */
+	seqadj = nfct_seqadj(ct);
+	if (seqadj != NULL)
+		seq -= seqadj->seq[IP_CT_DIR_REPLY].offset_after;
+	synproxy = nfct_synproxy(ct);
+	if (synproxy != NULL && (nopts.options & XT_SYNPROXY_OPT_TIMESTAMP))
+		nopts.tsval += synproxy->tsoff;
+	opts = &nopts;
+
+	nskb = synproxy_alloc_tcp(tuple->dst.u3.ip, tuple->src.u3.ip, opts,
+				  &niph, &nth, &tcp_hdr_size);
+	if (nskb == NULL)
+		return;
+
+	nth->source	= tuple->dst.u.tcp.port;
+	nth->dest	= tuple->src.u.tcp.port;
+	nth->seq	= htonl(seq);
+	nth->ack_seq	= htonl(ack_seq);
+	tcp_flag_word(nth) = TCP_FLAG_ACK;
+	nth->doff	= tcp_hdr_size / 4;
+	nth->window	= htons(window);
+	nth->check	= 0;
+	nth->urg_ptr	= 0;
+
+	synproxy_send_tcp(snet, skb, nskb, &ct->ct_general,
+			  IP_CT_ESTABLISHED_REPLY, niph, nth, tcp_hdr_size);
+}
+
+/* Reset the server half of @ct, @seq is in the sequence space of the client
+ * and must be the next one the server expects.
+ */
+static void
+synproxy_send_server_rst(const struct synproxy_net *snet,
+			 const struct sk_buff *skb, struct nf_conn *ct, u32 seq)
+{
+	const struct nf_conntrack_tuple *tuple;
+	struct sk_buff *nskb;
+	struct iphdr *niph;
+	struct tcphdr *nth;
+	unsigned int tcp_hdr_size;
+
+	tuple = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+	nskb = synproxy_alloc_tcp(tuple->src.u3.ip, tuple->dst.u3.ip, NULL,
+				  &niph, &nth, &tcp_hdr_size);
+	if (nskb == NULL)
+		return;
+
+	nth->source	= tuple->src.u.tcp.port;
+	nth->dest	= tuple->dst.u.tcp.port;
+	nth->seq	= htonl(seq);
+	nth->ack_seq	= 0;
+	tcp_flag_word(nth) = TCP_FLAG_RST;
+	nth->doff	= tcp_hdr_size / 4;
+	nth->window	= 0;
+	nth->check	= 0;
+	nth->urg_ptr	= 0;
+
+	synproxy_send_tcp(snet, skb, nskb, &ct->ct_general, IP_CT_ESTABLISHED,
+			  niph, nth, tcp_hdr_size);
+}
+
+/* Window scale advertised to the client in the SYN/ACK. */
+static u8
+synproxy_client_wscale(const struct xt_synproxy_info *info,
+		       const struct synproxy_options *opts)
+{
+	if (opts->options & info->options & XT_SYNPROXY_OPT_WSCALE)
+		return info->wscale;
+	return 0;
+}
+
 static bool
-synproxy_recv_client_ack(const struct synproxy_net *snet,
-			 const struct sk_buff *skb, const struct tcphdr *th,
-			 struct synproxy_options *opts, u32 recv_seq)
+synproxy_check_client_cookie(const struct synproxy_net *snet,
+			     const struct sk_buff *skb, const struct tcphdr *th,
+			     struct synproxy_options *opts)
 {
+	const struct iphdr *iph;
+	struct iphdr _iph;
 	int mss;
 
-	mss = __cookie_v4_check(ip_hdr(skb), th, ntohl(th->ack_seq) - 1);
+	iph = synproxy_cookie_iph(skb, &_iph);
+	mss = __cookie_v4_check(iph, th, ntohl(th->ack_seq) - 1);
+	trace_synproxy_cookie(iph, th, mss != 0);
 	if (mss == 0) {
 		this_cpu_inc(snet->stats->cookie_invalid);
 		return false;
@@ -309,209 +1154,2027 @@ synproxy_recv_client_ack(const struct synproxy_net *snet,
 	if (opts->options & XT_SYNPROXY_OPT_TIMESTAMP)
 		synproxy_check_timestamp_cookie(opts);
 
+	return true;
+}
+
+static bool
+synproxy_recv_client_ack(const struct synproxy_net *snet,
+			 const struct sk_buff *skb, const struct tcphdr *th,
+			 struct synproxy_options *opts, u32 recv_seq)
+{
+	if (!synproxy_check_client_cookie(snet, skb, th, opts))
+		return false;
+
 	synproxy_send_server_syn(snet, skb, th, opts, recv_seq);
 	return true;
 }
 
-static int synproxy_dummy_ouput(struct net *net, struct sock *sk, struct sk_buff *skb)
+/* Store of client segments waiting for the server handshake, keyed by
+ * conntrack. An entry holds a reference to its conntrack entry, so the key
+ * cannot be reused while it exists. Segments of a flow and the server SYN/ACK
+ * may arrive on any CPU, so the store is shared and split into buckets by
+ * the hash of the key, each with its own lock. Entries of a bucket are kept
+ * in order of expiry; a single timer reaps the expired ones while the store
+ * is not empty.
+ */
+#define SYNPROXY_STASH_BITS	10
+
+struct synproxy_stash_entry {
+	struct list_head		list;
+	struct nf_conn			*ct;
+	struct sk_buff_head		queue;
+	unsigned long			timeout;
+	unsigned int			truesize;
+	unsigned int			len;
+	u32				isn;
+	u32				rcv_nxt;
+	u8				wscale;
+};
+
+struct synproxy_stash_bucket {
+	spinlock_t			lock;
+	struct list_head		list;
+};
+
+static struct synproxy_stash_bucket synproxy_stash[1 << SYNPROXY_STASH_BITS];
+static atomic_t synproxy_stash_count;
+static atomic_t synproxy_stash_bytes;
+static struct timer_list synproxy_stash_timer;
+
+enum synproxy_stash_res {
+	SYNPROXY_STASH_NONE,
+	SYNPROXY_STASH_QUEUED,
+	SYNPROXY_STASH_DUP,
+	SYNPROXY_STASH_FULL,
+};
+
+/* What to acknowledge to the client after a segment was offered. */
+struct synproxy_stash_ack {
+	u32				rcv_nxt;
+	u16				window;
+};
+
+static inline struct synproxy_stash_bucket *
+synproxy_stash_bucket(const struct nf_conn *ct)
 {
-	return 0;
+	return &synproxy_stash[hash_ptr(ct, SYNPROXY_STASH_BITS)];
 }
 
-static unsigned int
-synproxy_tg4(struct sk_buff *skb, const struct xt_action_param *par)
+static void synproxy_stash_unlink(struct synproxy_stash_entry *e)
 {
-	const struct xt_synproxy_info *info = par->targinfo;
-	struct synproxy_net *snet = synproxy_pernet(par->net);
-	struct synproxy_options opts = {};
-	struct tcphdr *th, _th;
+	list_del(&e->list);
+	atomic_dec(&synproxy_stash_count);
+	atomic_sub(e->truesize, &synproxy_stash_bytes);
+}
 
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
-	ct = nf_ct_get(skb, &ctinfo);
+static void synproxy_stash_free(struct synproxy_stash_entry *e)
+{
+	__skb_queue_purge(&e->queue);
+	nf_ct_put(e->ct);
+	kfree(e);
+}
 
-	if (nf_ip_checksum(skb, par->hooknum, par->thoff, IPPROTO_TCP))
-		return NF_DROP;
+static struct synproxy_stash_entry *
+__synproxy_stash_find(struct synproxy_stash_bucket *b, const struct nf_conn *ct)
+{
+	struct synproxy_stash_entry *e;
 
-	th = skb_header_pointer(skb, par->thoff, sizeof(_th), &_th);
-	if (th == NULL)
-		return NF_DROP;
+	list_for_each_entry(e, &b->list, list) {
+		if (e->ct == ct)
+			return e;
+	}
+	return NULL;
+}
 
-	if (!synproxy_parse_options(skb, par->thoff, th, &opts))
-		return NF_DROP;
+/* Returns with the lock of the bucket of @ct taken if it has an entry. */
+static struct synproxy_stash_entry *
+synproxy_stash_find(const struct nf_conn *ct)
+{
+	struct synproxy_stash_bucket *b = synproxy_stash_bucket(ct);
+	struct synproxy_stash_entry *e;
 
-	if (th->syn && !(th->ack || th->fin || th->rst)) {
-		/* Initial SYN from client */
-		this_cpu_inc(snet->stats->syn_received);
+	spin_lock_bh(&b->lock);
+	e = __synproxy_stash_find(b, ct);
+	if (e == NULL)
+		spin_unlock_bh(&b->lock);
+	return e;
+}
 
-		if (th->ece && th->cwr)
-			opts.options |= XT_SYNPROXY_OPT_ECN;
+static inline bool synproxy_stash_over_limit(void)
+{
+	return atomic_read(&synproxy_stash_count) >= stash_max_entries ||
+	       atomic_read(&synproxy_stash_bytes) >= stash_max_bytes;
+}
 
-		opts.options &= info->options;
-		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
-			synproxy_init_timestamp_cookie(info, &opts);
+/* Create the entry for @ct. @isn is the client initial sequence number,
+ * @wscale the window scale advertised to the client. Over the limits the
+ * oldest entries of the same bucket are evicted, if it has none the entry
+ * is not created.
+ */
+static bool
+synproxy_stash_open(struct net *net, struct nf_conn *ct, u32 isn, u8 wscale)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_stash_bucket *b = synproxy_stash_bucket(ct);
+	struct synproxy_stash_entry *e, *old;
+
+	e = kmalloc(sizeof(*e), GFP_ATOMIC);
+	if (e == NULL)
+		return false;
+
+	spin_lock_bh(&b->lock);
+	if (__synproxy_stash_find(b, ct) != NULL) {
+		spin_unlock_bh(&b->lock);
+		kfree(e);
+		return true;
+	}
+
+	while (!list_empty(&b->list)) {
+		old = list_first_entry(&b->list, struct synproxy_stash_entry,
+				       list);
+		if (time_after(jiffies, old->timeout))
+			this_cpu_inc(dnet->stats->stash_expired);
+		else if (synproxy_stash_over_limit())
+			this_cpu_inc(dnet->stats->stash_evicted);
 		else
-			opts.options &= ~(XT_SYNPROXY_OPT_WSCALE |
-					  XT_SYNPROXY_OPT_SACK_PERM |
-					  XT_SYNPROXY_OPT_ECN);
+			break;
+
+		synproxy_stash_unlink(old);
+		synproxy_stash_free(old);
+	}
 
-		if (ct) {
-			struct net_device *dev = skb_dst(skb)->dev;
-			struct net_device *orig_dev = skb->dev;
+	if (synproxy_stash_over_limit()) {
+		spin_unlock_bh(&b->lock);
+		this_cpu_inc(dnet->stats->stash_full);
+		kfree(e);
+		return false;
+	}
 
-			skb->dev = dev;
-			skb->protocol = htons(ETH_P_IP);
+	nf_conntrack_get(&ct->ct_general);
+	e->ct = ct;
+	__skb_queue_head_init(&e->queue);
+	e->timeout = jiffies + msecs_to_jiffies(stash_timeout);
+	e->truesize = 0;
+	e->len = 0;
+	e->isn = isn;
+	e->rcv_nxt = isn + 1;
+	e->wscale = wscale;
+	list_add_tail(&e->list, &b->list);
+	atomic_inc(&synproxy_stash_count);
+	spin_unlock_bh(&b->lock);
 
-			NF_HOOK(NFPROTO_IPV4, NF_INET_POST_ROUTING,
-					par->net, skb->sk, skb, NULL, skb->dev,
-					synproxy_dummy_ouput);
-			skb->dev = orig_dev;
+	if (!timer_pending(&synproxy_stash_timer))
+		mod_timer(&synproxy_stash_timer, e->timeout + 1);
+	return true;
+}
 
-			nf_conntrack_confirm(skb);
-			ct->mark = SYNPROXY_IN_PROGRESS;
-		}
-		synproxy_send_client_synack(snet, skb, th, &opts);
-		return NF_DROP;
+/* Append a segment carrying @len bytes starting at @seq. Only segments
+ * continuing the data already stored are accepted, anything else is left
+ * for the client to retransmit.
+ */
+static enum synproxy_stash_res
+synproxy_stash_queue(struct net *net, const struct nf_conn *ct,
+		     struct sk_buff *skb, u32 seq, unsigned int len,
+		     struct synproxy_stash_ack *ack)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_stash_entry *e;
+	enum synproxy_stash_res res;
+	unsigned int limit;
 
-	} else if (th->ack && !(th->fin || th->rst || th->syn)) {
-		/* ACK from client */
-		if (ct)
-			ct->mark = SYNPROXY_FINISH;
+	e = synproxy_stash_find(ct);
+	if (e == NULL)
+		return SYNPROXY_STASH_NONE;
 
-		synproxy_recv_client_ack(snet, skb, th, &opts, ntohl(th->seq));
+	limit = rx_max_bytes ? : UINT_MAX;
+	if (seq != e->rcv_nxt) {
+		res = SYNPROXY_STASH_DUP;
+	} else if (e->len + len > limit ||
+		   atomic_read(&synproxy_stash_bytes) + skb->truesize >
+		   stash_max_bytes) {
+		this_cpu_inc(dnet->stats->stash_full);
+		res = SYNPROXY_STASH_FULL;
+	} else {
+		/* The segment outlives the RCU section it was received in. */
+		skb_dst_force(skb);
+		skb->dev = skb_dst(skb)->dev;
 
-		return NF_DROP;
+		__skb_queue_tail(&e->queue, skb);
+		e->truesize += skb->truesize;
+		e->len += len;
+		e->rcv_nxt += len;
+		atomic_add(skb->truesize, &synproxy_stash_bytes);
+		this_cpu_inc(dnet->stats->stash_stored);
+		res = SYNPROXY_STASH_QUEUED;
 	}
 
-	return XT_CONTINUE;
+	ack->rcv_nxt = e->rcv_nxt;
+	ack->window = min_t(unsigned int, (limit - e->len) >> e->wscale, 0xffff);
+	spin_unlock_bh(&synproxy_stash_bucket(ct)->lock);
+
+	return res;
 }
 
-static unsigned int ipv4_synproxy_hook(void *priv,
-				       struct sk_buff *skb,
-				       const struct nf_hook_state *nhs)
+static bool synproxy_stash_isn(const struct nf_conn *ct, u32 *isn)
 {
-	struct synproxy_net *snet = synproxy_pernet(nhs->net);
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
-	struct nf_conn_synproxy *synproxy;
-	struct synproxy_options opts = {};
-	const struct ip_ct_tcp *state;
-	struct tcphdr *th, _th;
-	unsigned int thoff;
+	struct synproxy_stash_entry *e;
 
-	ct = nf_ct_get(skb, &ctinfo);
-	if (ct == NULL)
-		return NF_ACCEPT;
+	e = synproxy_stash_find(ct);
+	if (e == NULL)
+		return false;
 
-	if (CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL && ct->mark == SYNPROXY_IN_PROGRESS)
-		return NF_DROP;
+	*isn = e->isn;
+	spin_unlock_bh(&synproxy_stash_bucket(ct)->lock);
+	return true;
+}
 
-	synproxy = nfct_synproxy(ct);
-	if (synproxy == NULL)
-		return NF_ACCEPT;
+static struct synproxy_stash_entry *
+synproxy_stash_take(const struct nf_conn *ct)
+{
+	struct synproxy_stash_entry *e;
 
-	if (nf_is_loopback_packet(skb))
-		return NF_ACCEPT;
+	e = synproxy_stash_find(ct);
+	if (e == NULL)
+		return NULL;
 
-	thoff = ip_hdrlen(skb);
-	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
-	if (th == NULL)
-		return NF_DROP;
+	synproxy_stash_unlink(e);
+	spin_unlock_bh(&synproxy_stash_bucket(ct)->lock);
+	return e;
+}
 
-	state = &ct->proto.tcp;
-	switch (state->state) {
-	case TCP_CONNTRACK_CLOSE:
-		if (th->rst && !test_bit(IPS_SEEN_REPLY_BIT, &ct->status)) {
-			nf_ct_seqadj_init(ct, ctinfo, synproxy->isn -
-						      ntohl(th->seq) + 1);
-			break;
-		}
+/* The connection is gone, its stored segments will never be sent. */
+static void synproxy_stash_drop(const struct nf_conn *ct)
+{
+	struct synproxy_stash_entry *e;
 
-		if (!th->syn || th->ack ||
-		    CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL)
-			break;
+	e = synproxy_stash_take(ct);
+	if (e != NULL)
+		synproxy_stash_free(e);
+}
 
-		/* Reopened connection - reset the sequence number and timestamp
-		 * adjustments, they will get initialized once the connection is
-		 * reestablished.
-		 */
-		nf_ct_seqadj_init(ct, ctinfo, 0);
-		synproxy->tsoff = 0;
-		this_cpu_inc(snet->stats->conn_reopened);
+static void synproxy_stash_timer_fn(unsigned long data)
+{
+	struct synproxy_stash_bucket *b;
+	struct synproxy_stash_entry *e;
+	struct synproxy_dpi_net *dnet;
+	unsigned long next = 0;
+	bool pending = false;
+	unsigned int i;
 
-		/* fall through */
-	case TCP_CONNTRACK_SYN_SENT:
-		if (!synproxy_parse_options(skb, thoff, th, &opts))
-			return NF_DROP;
+	for (i = 0; i < ARRAY_SIZE(synproxy_stash); i++) {
+		if (atomic_read(&synproxy_stash_count) == 0)
+			break;
 
-		if (!th->syn && th->ack &&
-		    CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL) {
-			/* Keep-Alives are sent with SEG.SEQ = SND.NXT-1,
-			 * therefore we need to add 1 to make the SYN sequence
-			 * number match the one of first SYN.
-			 */
-			if (synproxy_recv_client_ack(snet, skb, th, &opts,
-						     ntohl(th->seq) + 1))
-				this_cpu_inc(snet->stats->cookie_retrans);
+		b = &synproxy_stash[i];
+		if (list_empty_careful(&b->list))
+			continue;
 
-			return NF_DROP;
+		spin_lock_bh(&b->lock);
+		while (!list_empty(&b->list)) {
+			e = list_first_entry(&b->list,
+					     struct synproxy_stash_entry, list);
+			if (!time_after(jiffies, e->timeout)) {
+				if (!pending || time_before(e->timeout, next))
+					next = e->timeout;
+				pending = true;
+				break;
+			}
+			dnet = synproxy_dpi_pernet(nf_ct_net(e->ct));
+			this_cpu_inc(dnet->stats->stash_expired);
+			synproxy_stash_unlink(e);
+			synproxy_stash_free(e);
 		}
+		spin_unlock_bh(&b->lock);
+	}
 
-		synproxy->isn = ntohl(th->ack_seq);
-		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
-			synproxy->its = opts.tsecr;
-		break;
-	case TCP_CONNTRACK_SYN_RECV:
-		if (!th->syn || !th->ack)
-			break;
-
-		if (!synproxy_parse_options(skb, thoff, th, &opts))
-			return NF_DROP;
+	if (pending)
+		mod_timer(&synproxy_stash_timer, next + 1);
+}
 
-		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
-			synproxy->tsoff = opts.tsval - synproxy->its;
+/* Does @e belong to @net, or hold a segment routed through @dev? */
+static bool synproxy_stash_match(const struct synproxy_stash_entry *e,
+				 const struct net *net,
+				 const struct net_device *dev)
+{
+	struct sk_buff *skb;
 
-		opts.options &= ~(XT_SYNPROXY_OPT_MSS |
-				  XT_SYNPROXY_OPT_WSCALE |
-				  XT_SYNPROXY_OPT_SACK_PERM);
+	if (net != NULL && !net_eq(nf_ct_net(e->ct), net))
+		return false;
+	if (dev == NULL)
+		return true;
 
-		swap(opts.tsval, opts.tsecr);
-		synproxy_send_server_ack(snet, state, skb, th, &opts);
+	skb_queue_walk(&e->queue, skb) {
+		if (skb->dev == dev)
+			return true;
+	}
+	return false;
+}
 
-		nf_ct_seqadj_init(ct, ctinfo, synproxy->isn - ntohl(th->seq));
+/* Drop the entries of @net, or those holding a route through @dev, or all of
+ * them if both are NULL.
+ */
+static void synproxy_stash_flush(const struct net *net,
+				 const struct net_device *dev)
+{
+	struct synproxy_stash_entry *e, *next;
+	struct synproxy_stash_bucket *b;
+	unsigned int i;
 
-		swap(opts.tsval, opts.tsecr);
-		synproxy_send_client_ack(snet, skb, th, &opts);
+	for (i = 0; i < ARRAY_SIZE(synproxy_stash); i++) {
+		b = &synproxy_stash[i];
 
-		consume_skb(skb);
-		return NF_STOLEN;
-	default:
-		break;
+		spin_lock_bh(&b->lock);
+		list_for_each_entry_safe(e, next, &b->list, list) {
+			if (!synproxy_stash_match(e, net, dev))
+				continue;
+			synproxy_stash_unlink(e);
+			synproxy_stash_free(e);
+		}
+		spin_unlock_bh(&b->lock);
 	}
-
-	synproxy_tstamp_adjust(skb, thoff, th, ct, ctinfo, synproxy);
-	return NF_ACCEPT;
 }
 
-static int synproxy_tg4_check(const struct xt_tgchk_param *par)
+static void synproxy_stash_init(void)
 {
-	const struct ipt_entry *e = par->entryinfo;
-
-	if (e->ip.proto != IPPROTO_TCP ||
-	    e->ip.invflags & XT_INV_PROTO)
-		return -EINVAL;
+	unsigned int i;
 
-	return nf_ct_l3proto_try_module_get(par->family);
+	for (i = 0; i < ARRAY_SIZE(synproxy_stash); i++) {
+		spin_lock_init(&synproxy_stash[i].lock);
+		INIT_LIST_HEAD(&synproxy_stash[i].list);
+	}
+	setup_timer(&synproxy_stash_timer, synproxy_stash_timer_fn, 0);
 }
 
-static void synproxy_tg4_destroy(const struct xt_tgdtor_param *par)
+/* A device being unregistered waits for the references to its routes,
+ * cached or held by the stored segments.
+ */
+static int synproxy_route_netdev_event(struct notifier_block *this,
+				       unsigned long event, void *ptr)
 {
-	nf_ct_l3proto_module_put(par->family);
+	struct net_device *dev = netdev_notifier_info_to_dev(ptr);
+
+	if (event == NETDEV_UNREGISTER) {
+		synproxy_route_flush(synproxy_dpi_pernet(dev_net(dev)));
+		synproxy_stash_flush(dev_net(dev), dev);
+	}
+
+	return NOTIFY_DONE;
 }
 
-static struct xt_target synproxy_tg4_reg __read_mostly = {
-	.name		= "SYNPROXY",
-	.family		= NFPROTO_IPV4,
+static struct notifier_block synproxy_route_netdev_notifier = {
+	.notifier_call	= synproxy_route_netdev_event,
+};
+
+/* Send the stored client segments to the server. They pass through
+ * POSTROUTING again, where NAT is reapplied (the manipulation is idempotent)
+ * and the sequence adjustment initialized for the server handshake applies.
+ */
+static void
+synproxy_stash_replay(struct net *net, struct nf_conn *ct)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_stash_entry *e;
+	struct sk_buff *skb;
+
+	e = synproxy_stash_take(ct);
+	if (e == NULL)
+		return;
+
+	/* Conntrack does not see the segments again, account for them in the
+	 * window so the server acknowledging them is not considered invalid.
+	 */
+	spin_lock_bh(&ct->lock);
+	if (after(e->rcv_nxt, ct->proto.tcp.seen[IP_CT_DIR_ORIGINAL].td_end))
+		ct->proto.tcp.seen[IP_CT_DIR_ORIGINAL].td_end = e->rcv_nxt;
+	spin_unlock_bh(&ct->lock);
+
+	while ((skb = __skb_dequeue(&e->queue)) != NULL) {
+		if (ip_route_me_harder(net, skb, RTN_UNSPEC)) {
+			kfree_skb(skb);
+			continue;
+		}
+
+		this_cpu_inc(dnet->stats->stash_replayed);
+		ip_local_out(net, NULL, skb);
+	}
+
+	synproxy_stash_free(e);
+}
+
+struct synproxy_verdict {
+	struct hlist_node		hnode;
+	struct list_head		lru;
+	struct rcu_head			rcu;
+	unsigned long			timeout;
+	__be32				daddr;
+	__be16				dport;
+	bool				referenced;
+	u32				mark;
+};
+
+static u32 synproxy_verdict_seed __read_mostly;
+
+static inline u32 synproxy_verdict_hash(__be32 daddr, __be16 dport)
+{
+	return jhash_2words((__force u32)daddr, (__force u32)dport,
+			    synproxy_verdict_seed) &
+	       ((1 << SYNPROXY_VERDICT_BITS) - 1);
+}
+
+static void synproxy_verdict_unlink(struct synproxy_verdict_cache *cache,
+				    struct synproxy_verdict *v)
+{
+	hlist_del_rcu(&v->hnode);
+	list_del(&v->lru);
+	cache->count--;
+	kfree_rcu(v, rcu);
+}
+
+/* Reclaim expired entries and shrink the cache to @limit entries. Eviction
+ * is a second chance LRU: an entry hit since it was last considered is moved
+ * to the tail once, so lookups never need the lock.
+ */
+static void synproxy_verdict_shrink(struct synproxy_dpi_net *dnet,
+				    unsigned int limit)
+{
+	struct synproxy_verdict_cache *cache = &dnet->verdicts;
+	unsigned int budget = cache->count;
+	struct synproxy_verdict *v;
+
+	while (!list_empty(&cache->lru)) {
+		v = list_first_entry(&cache->lru, struct synproxy_verdict, lru);
+		if (time_before(jiffies, v->timeout)) {
+			if (cache->count <= limit)
+				break;
+			if (v->referenced && budget) {
+				budget--;
+				v->referenced = false;
+				list_move_tail(&v->lru, &cache->lru);
+				continue;
+			}
+		}
+
+		synproxy_verdict_unlink(cache, v);
+		this_cpu_inc(dnet->stats->verdict_evicted);
+	}
+}
+
+/* Returns the mark DPI gave the last connection to @daddr:@dport, zero if
+ * there is no valid verdict.
+ */
+static u32
+synproxy_verdict_lookup(struct net *net, __be32 daddr, __be16 dport)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_verdict *v;
+	u32 mark = 0;
+
+	if (!verdict_cache_size)
+		return 0;
+
+	rcu_read_lock();
+	hlist_for_each_entry_rcu(v, &dnet->verdicts.hash[synproxy_verdict_hash(daddr, dport)],
+				 hnode) {
+		if (v->daddr != daddr || v->dport != dport)
+			continue;
+
+		if (time_before(jiffies, READ_ONCE(v->timeout))) {
+			mark = READ_ONCE(v->mark);
+			if (!v->referenced)
+				WRITE_ONCE(v->referenced, true);
+		}
+		break;
+	}
+	rcu_read_unlock();
+
+	if (!mark)
+		this_cpu_inc(dnet->stats->verdict_miss);
+	return mark;
+}
+
+static void
+synproxy_verdict_update(struct net *net, __be32 daddr, __be16 dport, u32 mark)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_verdict_cache *cache = &dnet->verdicts;
+	struct hlist_head *head;
+	struct synproxy_verdict *v;
+
+	if (!verdict_cache_size)
+		return;
+
+	head = &cache->hash[synproxy_verdict_hash(daddr, dport)];
+
+	spin_lock_bh(&cache->lock);
+	hlist_for_each_entry(v, head, hnode) {
+		if (v->daddr == daddr && v->dport == dport) {
+			WRITE_ONCE(v->mark, mark);
+			WRITE_ONCE(v->timeout, jiffies + verdict_cache_timeout * HZ);
+			list_move_tail(&v->lru, &cache->lru);
+			goto out;
+		}
+	}
+
+	synproxy_verdict_shrink(dnet, verdict_cache_size - 1);
+
+	v = kmalloc(sizeof(*v), GFP_ATOMIC);
+	if (v == NULL)
+		goto out;
+
+	v->timeout = jiffies + verdict_cache_timeout * HZ;
+	v->daddr = daddr;
+	v->dport = dport;
+	v->referenced = false;
+	v->mark = mark;
+	hlist_add_head_rcu(&v->hnode, head);
+	list_add_tail(&v->lru, &cache->lru);
+	cache->count++;
+	this_cpu_inc(dnet->stats->verdict_stored);
+out:
+	spin_unlock_bh(&cache->lock);
+}
+
+static void synproxy_verdict_flush(struct synproxy_dpi_net *dnet)
+{
+	struct synproxy_verdict_cache *cache = &dnet->verdicts;
+	struct synproxy_verdict *v, *next;
+
+	spin_lock_bh(&cache->lock);
+	list_for_each_entry_safe(v, next, &cache->lru, lru)
+		synproxy_verdict_unlink(cache, v);
+	spin_unlock_bh(&cache->lock);
+}
+
+static void synproxy_verdict_init(struct synproxy_dpi_net *dnet)
+{
+	struct synproxy_verdict_cache *cache = &dnet->verdicts;
+	int i;
+
+	spin_lock_init(&cache->lock);
+	for (i = 0; i < ARRAY_SIZE(cache->hash); i++)
+		INIT_HLIST_HEAD(&cache->hash[i]);
+	INIT_LIST_HEAD(&cache->lru);
+	cache->count = 0;
+}
+
+static DEFINE_MUTEX(synproxy_trusted_mutex);
+
+/* Returns the first trusted set holding the destination of @skb. */
+static struct synproxy_trusted_set *
+synproxy_trusted_match(struct net *net, const struct sk_buff *skb,
+		       const struct xt_action_param *par)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct ip_set_adt_opt opt = {
+		.family		= NFPROTO_IPV4,
+		.dim		= IPSET_DIM_TWO,
+		.ext.timeout	= UINT_MAX,
+	};
+	struct synproxy_trusted_set *set = NULL;
+	ip_set_id_t index;
+	int i;
+
+	if (!READ_ONCE(dnet->trusted_count))
+		return NULL;
+
+	rcu_read_lock();
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++) {
+		index = READ_ONCE(dnet->trusted[i].index);
+		if (index == IPSET_INVALID_ID)
+			continue;
+
+		if (ip_set_test(index, skb, par, &opt)) {
+			set = &dnet->trusted[i];
+			break;
+		}
+	}
+	rcu_read_unlock();
+
+	return set;
+}
+
+static struct synproxy_trusted_set *
+synproxy_trusted_find(struct synproxy_dpi_net *dnet, const char *name)
+{
+	int i;
+
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++) {
+		if (dnet->trusted[i].index != IPSET_INVALID_ID &&
+		    !strcmp(dnet->trusted[i].name, name))
+			return &dnet->trusted[i];
+	}
+	return NULL;
+}
+
+static int synproxy_trusted_add(struct net *net, const char *name)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_trusted_set *set = NULL;
+	ip_set_id_t index;
+	struct ip_set *s;
+	int i, err = 0;
+
+	if (strlen(name) >= IPSET_MAXNAMELEN)
+		return -EINVAL;
+
+	mutex_lock(&synproxy_trusted_mutex);
+	if (synproxy_trusted_find(dnet, name) != NULL) {
+		err = -EEXIST;
+		goto out;
+	}
+
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++) {
+		if (dnet->trusted[i].index == IPSET_INVALID_ID) {
+			set = &dnet->trusted[i];
+			break;
+		}
+	}
+	if (set == NULL) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	index = ip_set_get_byname(net, name, &s);
+	if (index == IPSET_INVALID_ID) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	strlcpy(set->name, name, sizeof(set->name));
+	atomic_set(&set->hit, 0);
+	atomic_set(&set->abort, 0);
+	smp_wmb();
+	WRITE_ONCE(set->index, index);
+	dnet->trusted_count++;
+out:
+	mutex_unlock(&synproxy_trusted_mutex);
+	return err;
+}
+
+static void synproxy_trusted_release(struct net *net,
+				     struct synproxy_dpi_net *dnet,
+				     struct synproxy_trusted_set *set)
+{
+	ip_set_id_t index = set->index;
+
+	WRITE_ONCE(set->index, IPSET_INVALID_ID);
+	dnet->trusted_count--;
+	synchronize_rcu();
+	ip_set_put_byindex(net, index);
+}
+
+static int synproxy_trusted_del(struct net *net, const char *name)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_trusted_set *set;
+	int err = 0;
+
+	mutex_lock(&synproxy_trusted_mutex);
+	set = synproxy_trusted_find(dnet, name);
+	if (set != NULL)
+		synproxy_trusted_release(net, dnet, set);
+	else
+		err = -ENOENT;
+	mutex_unlock(&synproxy_trusted_mutex);
+
+	return err;
+}
+
+static void synproxy_trusted_flush(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	int i;
+
+	mutex_lock(&synproxy_trusted_mutex);
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++) {
+		if (dnet->trusted[i].index != IPSET_INVALID_ID)
+			synproxy_trusted_release(net, dnet, &dnet->trusted[i]);
+	}
+	mutex_unlock(&synproxy_trusted_mutex);
+}
+
+static void synproxy_trusted_init(struct synproxy_dpi_net *dnet)
+{
+	int i;
+
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++)
+		dnet->trusted[i].index = IPSET_INVALID_ID;
+	dnet->trusted_count = 0;
+}
+
+static u32 synproxy_inprog_seed __read_mostly;
+
+struct synproxy_inprog_src {
+	struct hlist_node		hnode;
+	__be32				saddr;
+	unsigned int			count;
+};
+
+/* Holds a reference to the connection until its in-progress time is over */
+struct synproxy_inprog {
+	struct list_head		list;
+	struct hlist_node		hnode;
+	struct nf_conn			*ct;
+	unsigned long			timeout;
+};
+
+static inline __be32 synproxy_inprog_saddr(const struct nf_conn *ct)
+{
+	return ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+}
+
+static inline struct hlist_head *
+synproxy_inprog_bucket(struct synproxy_inprog_table *table, __be32 saddr)
+{
+	return &table->hash[jhash_1word((__force u32)saddr, synproxy_inprog_seed) &
+			    ((1 << SYNPROXY_INPROG_BITS) - 1)];
+}
+
+/* A client packet in FORWARD carries the original source and, after DNAT,
+ * the source of the reply. SNAT only changes the reply destination.
+ */
+static inline struct hlist_head *
+synproxy_inprog_conn_bucket(struct synproxy_inprog_table *table,
+			    __be32 saddr, __be32 daddr,
+			    __be16 sport, __be16 dport)
+{
+	return &table->conns[jhash_3words((__force u32)saddr, (__force u32)daddr,
+					  (__force u32)sport << 16 |
+					  (__force u32)dport,
+					  synproxy_inprog_seed) &
+			     ((1 << SYNPROXY_INPROG_BITS) - 1)];
+}
+
+static inline struct hlist_head *
+synproxy_inprog_ct_bucket(struct synproxy_inprog_table *table,
+			  const struct nf_conn *ct)
+{
+	const struct nf_conntrack_tuple *orig = &ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+	const struct nf_conntrack_tuple *reply = &ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+
+	return synproxy_inprog_conn_bucket(table, orig->src.u3.ip,
+					   reply->src.u3.ip, orig->src.u.tcp.port,
+					   reply->src.u.tcp.port);
+}
+
+/* Returns a reference to the connection in progress a client packet seen in
+ * FORWARD as @tuple belongs to, whatever NAT is applied to it.
+ */
+static struct nf_conn *
+synproxy_inprog_find(struct net *net, const struct nf_conntrack_zone *zone,
+		     const struct nf_conntrack_tuple *tuple)
+{
+	struct synproxy_inprog_table *table = &synproxy_dpi_pernet(net)->inprog;
+	const struct nf_conntrack_tuple *orig, *reply;
+	struct synproxy_inprog *p;
+	struct nf_conn *ct = NULL;
+
+	spin_lock_bh(&table->lock);
+	hlist_for_each_entry(p, synproxy_inprog_conn_bucket(table,
+			     tuple->src.u3.ip, tuple->dst.u3.ip,
+			     tuple->src.u.tcp.port, tuple->dst.u.tcp.port),
+			     hnode) {
+		orig = &p->ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+		reply = &p->ct->tuplehash[IP_CT_DIR_REPLY].tuple;
+		if (orig->src.u3.ip == tuple->src.u3.ip &&
+		    orig->src.u.tcp.port == tuple->src.u.tcp.port &&
+		    reply->src.u3.ip == tuple->dst.u3.ip &&
+		    reply->src.u.tcp.port == tuple->dst.u.tcp.port &&
+		    nf_ct_zone_equal_any(p->ct, zone)) {
+			ct = p->ct;
+			nf_conntrack_get(&ct->ct_general);
+			break;
+		}
+	}
+	spin_unlock_bh(&table->lock);
+	return ct;
+}
+
+static struct synproxy_inprog_src *
+synproxy_inprog_src_find(struct synproxy_inprog_table *table, __be32 saddr)
+{
+	struct synproxy_inprog_src *src;
+
+	hlist_for_each_entry(src, synproxy_inprog_bucket(table, saddr), hnode) {
+		if (src->saddr == saddr)
+			return src;
+	}
+	return NULL;
+}
+
+static void synproxy_inprog_src_put(struct synproxy_inprog_table *table,
+				    __be32 saddr)
+{
+	struct synproxy_inprog_src *src;
+
+	spin_lock_bh(&table->lock);
+	src = synproxy_inprog_src_find(table, saddr);
+	if (src != NULL && --src->count == 0) {
+		hlist_del(&src->hnode);
+		kfree(src);
+	}
+	spin_unlock_bh(&table->lock);
+}
+
+/* The connection left the in-progress state, normal timeouts apply again. */
+static void synproxy_inprog_release(struct net *net, struct nf_conn *ct,
+				    struct synproxy_dpi_ext *dext)
+{
+	bool counted;
+
+	spin_lock_bh(&ct->lock);
+	counted = dext->flags & SYNPROXY_F_COUNTED;
+	dext->flags &= ~SYNPROXY_F_COUNTED;
+	spin_unlock_bh(&ct->lock);
+
+	if (!counted)
+		return;
+
+	clear_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status);
+	synproxy_inprog_src_put(&synproxy_dpi_pernet(net)->inprog,
+				synproxy_inprog_saddr(ct));
+}
+
+/* Drop the references of the connections whose time is over, or of all of
+ * them. The ones still in progress are removed from the conntrack table,
+ * which their fixed timeout normally did already.
+ */
+static void synproxy_inprog_reap(struct net *net, bool all)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_inprog_table *table = &dnet->inprog;
+	struct synproxy_inprog *p, *next;
+	struct synproxy_dpi_ext *dext;
+	LIST_HEAD(expired);
+	bool counted;
+
+	spin_lock_bh(&table->lock);
+	list_for_each_entry_safe(p, next, &table->list, list) {
+		if (!all && time_before(jiffies, p->timeout))
+			break;
+		hlist_del(&p->hnode);
+		list_move_tail(&p->list, &expired);
+	}
+	spin_unlock_bh(&table->lock);
+
+	list_for_each_entry_safe(p, next, &expired, list) {
+		dext = synproxy_dpi_ext(p->ct);
+
+		spin_lock_bh(&p->ct->lock);
+		counted = dext->flags & SYNPROXY_F_COUNTED;
+		dext->flags &= ~SYNPROXY_F_COUNTED;
+		spin_unlock_bh(&p->ct->lock);
+
+		if (counted) {
+			nf_ct_kill(p->ct);
+			if (rx_max_bytes)
+				synproxy_stash_drop(p->ct);
+			this_cpu_inc(dnet->stats->in_progress_evicted);
+			synproxy_inprog_src_put(table, synproxy_inprog_saddr(p->ct));
+		}
+
+		nf_ct_put(p->ct);
+		kfree(p);
+	}
+}
+
+static void synproxy_inprog_timer_fn(unsigned long data)
+{
+	struct net *net = (struct net *)data;
+	struct synproxy_inprog_table *table = &synproxy_dpi_pernet(net)->inprog;
+	struct synproxy_inprog *p;
+
+	synproxy_inprog_reap(net, false);
+
+	/* The first entry expires first, connections added meanwhile may have
+	 * armed the timer for a later one.
+	 */
+	spin_lock_bh(&table->lock);
+	p = list_first_entry_or_null(&table->list, struct synproxy_inprog,
+				     list);
+	if (p != NULL)
+		mod_timer(&table->timer, p->timeout);
+	spin_unlock_bh(&table->lock);
+}
+
+/* Limit the time DPI has for a new connection and the number of connections
+ * in progress per client. Called before the entry is confirmed, returns false
+ * if the client is over its limit.
+ */
+static bool synproxy_inprog_add(struct net *net, struct nf_conn *ct,
+				struct synproxy_dpi_ext *dext)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_inprog_table *table = &dnet->inprog;
+	struct synproxy_inprog_src *src;
+	struct synproxy_inprog *p;
+	__be32 saddr = synproxy_inprog_saddr(ct);
+	unsigned int limit = in_progress_per_source;
+
+	if (!in_progress_timeout)
+		return true;
+
+	p = kmalloc(sizeof(*p), GFP_ATOMIC);
+	if (p == NULL)
+		return false;
+
+	spin_lock_bh(&table->lock);
+	src = synproxy_inprog_src_find(table, saddr);
+	if (src == NULL) {
+		src = kmalloc(sizeof(*src), GFP_ATOMIC);
+		if (src == NULL)
+			goto err;
+		src->saddr = saddr;
+		src->count = 0;
+		hlist_add_head(&src->hnode, synproxy_inprog_bucket(table, saddr));
+	} else if (limit && src->count >= limit) {
+		this_cpu_inc(dnet->stats->in_progress_limit);
+		goto err;
+	}
+	src->count++;
+
+	nf_conntrack_get(&ct->ct_general);
+	p->ct = ct;
+	p->timeout = jiffies + in_progress_timeout * HZ;
+	list_add_tail(&p->list, &table->list);
+	hlist_add_head(&p->hnode, synproxy_inprog_ct_bucket(table, ct));
+	if (!timer_pending(&table->timer))
+		mod_timer(&table->timer, p->timeout);
+	spin_unlock_bh(&table->lock);
+
+	/* The timeout is still relative until the entry is confirmed. */
+	ct->timeout.expires = in_progress_timeout * HZ;
+	__set_bit(IPS_FIXED_TIMEOUT_BIT, &ct->status);
+	dext->flags |= SYNPROXY_F_COUNTED;
+	return true;
+
+err:
+	spin_unlock_bh(&table->lock);
+	kfree(p);
+	return false;
+}
+
+static void synproxy_inprog_init(struct net *net)
+{
+	struct synproxy_inprog_table *table = &synproxy_dpi_pernet(net)->inprog;
+	int i;
+
+	spin_lock_init(&table->lock);
+	for (i = 0; i < ARRAY_SIZE(table->hash); i++) {
+		INIT_HLIST_HEAD(&table->hash[i]);
+		INIT_HLIST_HEAD(&table->conns[i]);
+	}
+	INIT_LIST_HEAD(&table->list);
+	setup_timer(&table->timer, synproxy_inprog_timer_fn, (unsigned long)net);
+}
+
+static int synproxy_dummy_ouput(struct net *net, struct sock *sk, struct sk_buff *skb)
+{
+	return 0;
+}
+
+/* Run the POSTROUTING chain once so that NAT sets up its bindings, then
+ * confirm the entry and put it into the in-progress state until DPI decides.
+ * @isn and @wscale describe the handshake with the client. Returns NULL if
+ * the state could not be allocated or the client has too many connections in
+ * progress, the entry is left unconfirmed then.
+ */
+static struct synproxy_dpi_ext *
+synproxy_confirm_in_progress(struct sk_buff *skb,
+			     const struct xt_action_param *par,
+			     struct nf_conn *ct, u32 isn, u8 wscale)
+{
+	struct net_device *dev = skb_dst(skb)->dev;
+	struct net_device *orig_dev = skb->dev;
+	struct synproxy_dpi_ext *dext;
+
+	/* Extensions can only be added safely before the entry is confirmed,
+	 * the one added last may move those before it.
+	 */
+	if (!nfct_seqadj(ct) && !nfct_seqadj_ext_add(ct))
+		return NULL;
+	dext = synproxy_dpi_ext_add(ct);
+	if (dext == NULL || !synproxy_inprog_add(par->net, ct, dext))
+		return NULL;
+	dext->state = SYNPROXY_IN_PROGRESS;
+	dext->tstamp_start = synproxy_dpi_now();
+	trace_synproxy_in_progress(ct, isn);
+
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+
+	NF_HOOK(NFPROTO_IPV4, NF_INET_POST_ROUTING,
+			par->net, skb->sk, skb, NULL, skb->dev,
+			synproxy_dummy_ouput);
+	skb->dev = orig_dev;
+
+	nf_conntrack_confirm(skb);
+
+	if (rx_max_bytes)
+		synproxy_stash_open(par->net, ct, isn, wscale);
+
+	return dext;
+}
+
+/* Called with ct->lock held, or before the entry is shared */
+static void synproxy_dpi_finish(struct nf_conn *ct, struct synproxy_dpi_ext *dext,
+				u32 mark)
+{
+	WRITE_ONCE(dext->state, SYNPROXY_FINISH);
+	dext->verdict = mark;
+	dext->tstamp_verdict = synproxy_dpi_now();
+	trace_synproxy_finish(ct, mark);
+	synproxy_latency_add(nf_ct_net(ct), SYNPROXY_LAT_VERDICT,
+			     READ_ONCE(dext->tstamp_client_ack),
+			     dext->tstamp_verdict);
+}
+
+/* Act as the receiver for a connection DPI has not decided on yet: in-order
+ * segments are acknowledged on behalf of the server and kept until the
+ * server handshake completes.
+ */
+static unsigned int
+synproxy_rx_segment(struct net *net, struct sk_buff *skb, struct nf_conn *ct)
+{
+	struct synproxy_net *snet = synproxy_pernet(net);
+	struct synproxy_options opts = {};
+	struct synproxy_stash_ack ack;
+	enum synproxy_stash_res res;
+	struct tcphdr *th, _th;
+	unsigned int thoff, len;
+	u32 seq, ack_seq;
+
+	thoff = ip_hdrlen(skb);
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL || th->syn || th->fin || th->rst || !th->ack)
+		return NF_DROP;
+
+	len = skb->len - thoff - th->doff * 4;
+	if (len == 0)
+		return NF_DROP;
+
+	if (!synproxy_parse_options(skb, thoff, th, &opts))
+		return NF_DROP;
+
+	seq = ntohl(th->seq);
+	ack_seq = ntohl(th->ack_seq);
+
+	/* Once queued the segment may be replayed on another CPU, keep it
+	 * around until the acknowledgement is built.
+	 */
+	skb_get(skb);
+	res = synproxy_stash_queue(net, ct, skb, seq, len, &ack);
+	if (res != SYNPROXY_STASH_NONE) {
+		opts.options &= XT_SYNPROXY_OPT_TIMESTAMP;
+		swap(opts.tsval, opts.tsecr);
+		synproxy_send_client_data_ack(snet, skb, ct, ack_seq,
+					      ack.rcv_nxt, ack.window, &opts);
+	}
+	consume_skb(skb);
+
+	return res == SYNPROXY_STASH_QUEUED ? NF_STOLEN : NF_DROP;
+}
+
+/* DPI allowed a connection whose server handshake was started speculatively.
+ * If the server already answered, the connection is completed here,
+ * otherwise the server SYN/ACK will do it.
+ */
+static unsigned int
+synproxy_speculative_allow(struct synproxy_net *snet, struct sk_buff *skb,
+			   const struct xt_action_param *par, struct nf_conn *ct,
+			   struct synproxy_dpi_ext *dext, const struct tcphdr *th)
+{
+	const struct ip_ct_tcp_state *server = &ct->proto.tcp.seen[IP_CT_DIR_REPLY];
+	enum synproxy_stash_res res = SYNPROXY_STASH_NONE;
+	struct synproxy_options opts = {};
+	struct synproxy_stash_ack ack;
+	unsigned int verdict = NF_ACCEPT;
+	unsigned int len;
+	u32 state, mark = synproxy_l7_mark(skb);
+
+	if (mark)
+		synproxy_verdict_update(par->net, ip_hdr(skb)->daddr, th->dest,
+					mark);
+
+	/* Store the segment before the state changes, whichever side
+	 * completes the connection replays it.
+	 */
+	len = skb->len - par->thoff - th->doff * 4;
+	if (len && (replay_first_segment || rx_max_bytes)) {
+		if (!rx_max_bytes)
+			synproxy_stash_open(par->net, ct, ntohl(th->seq) - 1, 0);
+		res = synproxy_stash_queue(par->net, ct, skb, ntohl(th->seq),
+					   len, &ack);
+		verdict = res == SYNPROXY_STASH_QUEUED ? NF_STOLEN : NF_DROP;
+	}
+
+	spin_lock_bh(&ct->lock);
+	state = dext->state;
+	if (synproxy_is_speculative(state))
+		synproxy_dpi_finish(ct, dext, mark);
+	spin_unlock_bh(&ct->lock);
+	synproxy_inprog_release(par->net, ct, dext);
+
+	if (state != SYNPROXY_SPECULATIVE_OPEN)
+		return verdict == NF_STOLEN ? NF_STOLEN : NF_DROP;
+
+	synproxy_stash_replay(par->net, ct);
+
+	/* Open the window the SYN/ACK kept closed. */
+	synproxy_send_client_data_ack(snet, skb, ct,
+				      nfct_synproxy(ct)->isn + 1,
+				      rx_max_bytes && res != SYNPROXY_STASH_NONE ?
+				      ack.rcv_nxt : ntohl(th->seq),
+				      min_t(u32, server->td_maxwin >> server->td_scale,
+					    0xffff),
+				      &opts);
+	return verdict;
+}
+
+/* The server answered a speculative SYN. Returns the state the connection
+ * is left in.
+ */
+static u32 synproxy_speculative_open(struct nf_conn *ct)
+{
+	struct synproxy_dpi_ext *dext = synproxy_dpi_ext(ct);
+	u32 state;
+
+	if (dext == NULL)
+		return 0;
+
+	spin_lock_bh(&ct->lock);
+	if (dext->tstamp_server_synack == 0) {
+		dext->tstamp_server_synack = synproxy_dpi_now();
+		synproxy_latency_add(nf_ct_net(ct), SYNPROXY_LAT_SERVER_RTT,
+				     dext->tstamp_server_syn,
+				     dext->tstamp_server_synack);
+	}
+	if (dext->state == SYNPROXY_SPECULATIVE)
+		dext->state = SYNPROXY_SPECULATIVE_OPEN;
+	state = dext->state;
+	spin_unlock_bh(&ct->lock);
+
+	return state;
+}
+
+/* DPI classified a speculative connection but no rule allowed it. The server
+ * half is reset now if it is established, else when its SYN/ACK arrives.
+ */
+static void
+synproxy_speculative_abort(const struct nf_hook_state *nhs,
+			   struct sk_buff *skb, struct nf_conn *ct,
+			   struct synproxy_dpi_ext *dext)
+{
+	struct synproxy_net *snet = synproxy_pernet(nhs->net);
+	struct synproxy_trusted_set *set;
+	struct xt_action_param par = {
+		.net		= nhs->net,
+		.in		= nhs->in,
+		.out		= nhs->out,
+		.hooknum	= nhs->hook,
+		.family		= NFPROTO_IPV4,
+		.thoff		= ip_hdrlen(skb),
+	};
+	u32 state;
+
+	spin_lock_bh(&ct->lock);
+	state = dext->state;
+	if (synproxy_is_speculative(state))
+		dext->state = SYNPROXY_IN_PROGRESS;
+	spin_unlock_bh(&ct->lock);
+
+	if (!synproxy_is_speculative(state))
+		return;
+
+	set = synproxy_trusted_match(nhs->net, skb, &par);
+	if (set != NULL)
+		atomic_inc(&set->abort);
+
+	if (state == SYNPROXY_SPECULATIVE_OPEN)
+		synproxy_send_server_rst(snet, skb, ct,
+					 ct->proto.tcp.seen[IP_CT_DIR_REPLY].td_maxack);
+}
+
+static unsigned int
+synproxy_tg4(struct sk_buff *skb, const struct xt_action_param *par)
+{
+	const struct xt_synproxy_info *info = par->targinfo;
+	struct synproxy_net *snet = synproxy_pernet(par->net);
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(par->net);
+	struct synproxy_trusted_set *set;
+	struct synproxy_dpi_ext *dext;
+	struct synproxy_options opts = {};
+	struct tcphdr *th, _th, _cth;
+	const struct tcphdr *cth;
+	struct synproxy_stash_ack ack;
+	unsigned int verdict = NF_DROP;
+	unsigned int len;
+	bool learn = false;
+	u32 isn, mark;
+
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	ct = nf_ct_get(skb, &ctinfo);
+
+	if (nf_ip_checksum(skb, par->hooknum, par->thoff, IPPROTO_TCP))
+		return NF_DROP;
+
+	th = skb_header_pointer(skb, par->thoff, sizeof(_th), &_th);
+	if (th == NULL)
+		return NF_DROP;
+
+	if (!synproxy_parse_options(skb, par->thoff, th, &opts))
+		return NF_DROP;
+
+	if (th->syn && !(th->ack || th->fin || th->rst)) {
+		/* Initial SYN from client */
+		this_cpu_inc(snet->stats->syn_received);
+		trace_synproxy_syn_recv(ip_hdr(skb), th);
+
+		if (th->ece && th->cwr)
+			opts.options |= XT_SYNPROXY_OPT_ECN;
+
+		opts.options &= info->options;
+		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
+			synproxy_init_timestamp_cookie(info, &opts);
+		else
+			opts.options &= ~(XT_SYNPROXY_OPT_WSCALE |
+					  XT_SYNPROXY_OPT_SACK_PERM |
+					  XT_SYNPROXY_OPT_ECN);
+
+		/* In cookie-only mode nothing is kept for the SYN, the
+		 * unconfirmed entry is released together with the packet.
+		 * The same is done for a server with a cached verdict or in
+		 * a trusted set, its handshake starts once the client ACK
+		 * arrives.
+		 */
+		if (ct && !cookie_only &&
+		    !synproxy_verdict_lookup(par->net, ip_hdr(skb)->daddr, th->dest) &&
+		    !synproxy_trusted_match(par->net, skb, par) &&
+		    !synproxy_confirm_in_progress(skb, par, ct, ntohl(th->seq),
+						  synproxy_client_wscale(info, &opts)))
+			return NF_DROP;
+
+		synproxy_send_client_synack(snet, skb, th, &opts);
+		return NF_DROP;
+
+	} else if (th->ack && !(th->fin || th->rst || th->syn)) {
+		/* ACK from client */
+		cth = th;
+		if (ct && !nf_ct_is_confirmed(ct)) {
+			/* No state was kept for the SYN: the conntrack entry
+			 * and its NAT binding are only built once the cookie
+			 * proves the client completed the handshake.
+			 */
+			if (!synproxy_check_client_cookie(snet, skb, th, &opts))
+				return NF_DROP;
+
+			dext = synproxy_confirm_in_progress(skb, par, ct,
+							    ntohl(th->seq) - 1,
+							    synproxy_client_wscale(info, &opts));
+			if (dext == NULL)
+				return NF_DROP;
+			dext->tstamp_client_ack = dext->tstamp_start;
+
+			/* The server is known to DPI, do not wait for data. */
+			mark = synproxy_verdict_lookup(par->net, ip_hdr(skb)->daddr,
+						       th->dest);
+			if (!mark) {
+				/* For a trusted server the handshake runs
+				 * in parallel with DPI.
+				 */
+				set = synproxy_trusted_match(par->net, skb, par);
+				if (set != NULL) {
+					atomic_inc(&set->hit);
+					WRITE_ONCE(dext->state, SYNPROXY_SPECULATIVE);
+					synproxy_send_server_syn(snet, skb, th, &opts,
+								 ntohl(th->seq));
+				}
+				return NF_DROP;
+			}
+
+			this_cpu_inc(dnet->stats->verdict_hit);
+			skb->mark = mark;
+			/* Confirmed above, other CPUs see the entry now */
+			spin_lock_bh(&ct->lock);
+			synproxy_dpi_finish(ct, dext, mark);
+			spin_unlock_bh(&ct->lock);
+			synproxy_inprog_release(par->net, ct, dext);
+		} else {
+			dext = ct ? synproxy_dpi_ext(ct) : NULL;
+
+			/* Data acknowledged by the proxy while in progress
+			 * moved the client past the sequence number the
+			 * cookie was issued for.
+			 */
+			if (ct && rx_max_bytes && synproxy_stash_isn(ct, &isn)) {
+				_cth = *th;
+				_cth.seq = htonl(isn + 1);
+				cth = &_cth;
+			}
+
+			if (!synproxy_check_client_cookie(snet, skb, cth, &opts))
+				return NF_DROP;
+
+			if (synproxy_is_speculative(synproxy_state(dext)))
+				return synproxy_speculative_allow(snet, skb, par,
+								  ct, dext, th);
+
+			mark = synproxy_l7_mark(skb);
+			if (dext) {
+				spin_lock_bh(&ct->lock);
+				learn = dext->state == SYNPROXY_IN_PROGRESS && mark;
+				synproxy_dpi_finish(ct, dext, mark);
+				spin_unlock_bh(&ct->lock);
+				synproxy_inprog_release(par->net, ct, dext);
+			}
+
+			if (learn)
+				synproxy_verdict_update(par->net, ip_hdr(skb)->daddr,
+							th->dest, mark);
+		}
+
+		/* The segment is stored before the server SYN goes out, its
+		 * SYN/ACK may be handled on another CPU right away.
+		 */
+		len = skb->len - par->thoff - th->doff * 4;
+		if (ct && len && (replay_first_segment || rx_max_bytes)) {
+			if (!rx_max_bytes)
+				synproxy_stash_open(par->net, ct,
+						    ntohl(th->seq) - 1, 0);
+			if (synproxy_stash_queue(par->net, ct, skb, ntohl(th->seq),
+						 len, &ack) == SYNPROXY_STASH_QUEUED)
+				verdict = NF_STOLEN;
+		}
+
+		synproxy_send_server_syn(snet, skb, cth, &opts, ntohl(cth->seq));
+		return verdict;
+	}
+
+	return XT_CONTINUE;
+}
+
+/* Packets of a connection DPI has not decided on yet. Returns NF_ACCEPT if
+ * the packet may go on through the synproxy hook.
+ */
+static unsigned int
+synproxy_in_progress_hook(const struct nf_hook_state *nhs, struct sk_buff *skb,
+			  struct nf_conn *ct, struct synproxy_dpi_ext *dext,
+			  enum ip_conntrack_info ctinfo)
+{
+	struct tcphdr *th, _th;
+	unsigned int thoff, len;
+
+	thoff = ip_hdrlen(skb);
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL)
+		return NF_DROP;
+	len = skb->len - thoff - th->doff * 4;
+
+	/* A server opened speculatively must not talk before the verdict. */
+	if (CTINFO2DIR(ctinfo) == IP_CT_DIR_REPLY) {
+		if (len == 0)
+			return NF_ACCEPT;
+		trace_synproxy_in_progress_drop(ip_hdr(skb), th, len);
+		return NF_DROP;
+	}
+
+	if (!synproxy_is_speculative(synproxy_state(dext))) {
+		/* Reset of a server half whose speculation was aborted */
+		if (th->rst && (dext->flags & SYNPROXY_F_SERVER))
+			return NF_ACCEPT;
+		goto hold;
+	}
+
+	/* Allowed segments leave the in-progress state in the SYNPROXY
+	 * target, a classified one getting here was denied. So was a segment
+	 * DPI gave up on.
+	 */
+	if (skb->mark || (READ_ONCE(dext->flags) & SYNPROXY_F_DONE)) {
+		synproxy_speculative_abort(nhs, skb, ct, dext);
+		trace_synproxy_in_progress_drop(ip_hdr(skb), th, len);
+		return NF_DROP;
+	}
+
+	/* Handshake with the server and pure ACKs of the client */
+	if (!len && !th->fin)
+		return NF_ACCEPT;
+hold:
+	if (rx_max_bytes)
+		return synproxy_rx_segment(nhs->net, skb, ct);
+	trace_synproxy_in_progress_drop(ip_hdr(skb), th, len);
+	return NF_DROP;
+}
+
+/* Forget which connections the ruleset accepted, they traverse the FORWARD
+ * chains again until their next packet reaches POSTROUTING.
+ */
+static void synproxy_fastpath_flush(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+
+	if (atomic_inc_return(&dnet->fastpath_gen) == 0)
+		atomic_inc(&dnet->fastpath_gen);
+}
+
+static const char * const synproxy_fastpath_modnames[] = {
+	"iptable_filter", "iptable_security",
+};
+
+static struct module *synproxy_fastpath_mods[SYNPROXY_FASTPATH_TABLES];
+static DEFINE_MUTEX(synproxy_fastpath_mutex);
+
+/* A table is freed together with its module without waiting for hooks of
+ * other modules, so the modules of the skipped tables stay loaded while the
+ * fast path is enabled.
+ */
+static void synproxy_fastpath_pin(struct module *mod)
+{
+	unsigned int i;
+
+	mutex_lock(&synproxy_fastpath_mutex);
+	for (i = 0; i < SYNPROXY_FASTPATH_TABLES; i++) {
+		if (synproxy_fastpath_mods[i] == NULL &&
+		    !strcmp(mod->name, synproxy_fastpath_modnames[i]) &&
+		    try_module_get(mod))
+			synproxy_fastpath_mods[i] = mod;
+	}
+	mutex_unlock(&synproxy_fastpath_mutex);
+}
+
+static int synproxy_fastpath_module_event(struct notifier_block *this,
+					  unsigned long event, void *ptr)
+{
+	if (event == MODULE_STATE_LIVE)
+		synproxy_fastpath_pin(ptr);
+
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block synproxy_fastpath_module_notifier = {
+	.notifier_call	= synproxy_fastpath_module_event,
+};
+
+static void synproxy_fastpath_pin_loaded(void)
+{
+	struct module *mod;
+	unsigned int i;
+
+	mutex_lock(&module_mutex);
+	for (i = 0; i < SYNPROXY_FASTPATH_TABLES; i++) {
+		mod = find_module(synproxy_fastpath_modnames[i]);
+		/* One still coming up is pinned once it is live */
+		if (mod != NULL && mod->state == MODULE_STATE_LIVE)
+			synproxy_fastpath_pin(mod);
+	}
+	mutex_unlock(&module_mutex);
+}
+
+static void synproxy_fastpath_unpin(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < SYNPROXY_FASTPATH_TABLES; i++) {
+		if (synproxy_fastpath_mods[i] != NULL)
+			module_put(synproxy_fastpath_mods[i]);
+		synproxy_fastpath_mods[i] = NULL;
+	}
+}
+
+/* Set once the module is initialized, the fast path is started and stopped
+ * from then on. Both are serialized by the parameter lock of the module.
+ */
+static bool synproxy_fastpath_ready;
+/* Started anew, the tables may have changed while the fast path was off */
+static unsigned int synproxy_fastpath_epoch;
+
+static int synproxy_fastpath_start(void)
+{
+	int err;
+
+	err = register_module_notifier(&synproxy_fastpath_module_notifier);
+	if (err < 0)
+		return err;
+	synproxy_fastpath_pin_loaded();
+	WRITE_ONCE(synproxy_fastpath_epoch, synproxy_fastpath_epoch + 1);
+	smp_wmb();
+	WRITE_ONCE(fastpath, true);
+	return 0;
+}
+
+static void synproxy_fastpath_stop(void)
+{
+	WRITE_ONCE(fastpath, false);
+	/* Hooks still looking at the tables are done after this */
+	synchronize_net();
+	unregister_module_notifier(&synproxy_fastpath_module_notifier);
+	synproxy_fastpath_unpin();
+}
+
+static int synproxy_fastpath_param_set(const char *val,
+				       const struct kernel_param *kp)
+{
+	bool enable;
+
+	if (strtobool(val, &enable))
+		return -EINVAL;
+
+	if (!synproxy_fastpath_ready) {
+		fastpath = enable;
+		return 0;
+	}
+	if (enable == fastpath)
+		return 0;
+	if (enable)
+		return synproxy_fastpath_start();
+	synproxy_fastpath_stop();
+	return 0;
+}
+
+static const struct kernel_param_ops synproxy_fastpath_param_ops = {
+	.set	= synproxy_fastpath_param_set,
+	.get	= param_get_bool,
+};
+
+static int synproxy_fastpath_init(void)
+{
+	int err;
+
+	kernel_param_lock(THIS_MODULE);
+	err = fastpath ? synproxy_fastpath_start() : 0;
+	synproxy_fastpath_ready = err == 0;
+	kernel_param_unlock(THIS_MODULE);
+	return err;
+}
+
+static void synproxy_fastpath_fini(void)
+{
+	kernel_param_lock(THIS_MODULE);
+	synproxy_fastpath_ready = false;
+	if (fastpath)
+		synproxy_fastpath_stop();
+	kernel_param_unlock(THIS_MODULE);
+}
+
+/* Generation of the ruleset, 0 if it can not be told. Loading rules into a
+ * table replaces its rule set, whatever the rules are, and starts a new
+ * generation.
+ */
+static u32 synproxy_fastpath_gen(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	const struct xt_table_info *rules;
+	struct xt_table *tables[SYNPROXY_FASTPATH_TABLES] = {
+		READ_ONCE(net->ipv4.iptable_filter),
+#ifdef CONFIG_SECURITY
+		READ_ONCE(net->ipv4.iptable_security),
+#endif
+	};
+	unsigned int i, epoch;
+
+	/* The tables of a dying namespace are freed after an RCU grace
+	 * period, which the hook we are called from is part of.
+	 */
+	if (atomic_read(&net->count) == 0)
+		return 0;
+
+	epoch = READ_ONCE(synproxy_fastpath_epoch);
+	if (READ_ONCE(dnet->fastpath_epoch) != epoch) {
+		WRITE_ONCE(dnet->fastpath_epoch, epoch);
+		synproxy_fastpath_flush(net);
+	}
+
+	for (i = 0; i < SYNPROXY_FASTPATH_TABLES; i++) {
+		rules = tables[i] ? READ_ONCE(tables[i]->private) : NULL;
+		if (READ_ONCE(dnet->fastpath_rules[i]) != rules) {
+			WRITE_ONCE(dnet->fastpath_rules[i], rules);
+			synproxy_fastpath_flush(net);
+		}
+	}
+	return atomic_read(&dnet->fastpath_gen);
+}
+
+/* A forwarded packet made it through the FORWARD chains: remember the
+ * direction of an allowed connection as accepted by this ruleset.
+ */
+static void synproxy_fastpath_learn(struct net *net, struct sk_buff *skb,
+				    struct nf_conn *ct,
+				    enum ip_conntrack_info ctinfo,
+				    struct synproxy_dpi_ext *dext)
+{
+	u32 gen = synproxy_fastpath_gen(net);
+	enum ip_conntrack_dir dir = CTINFO2DIR(ctinfo);
+
+	if (gen == 0 || READ_ONCE(dext->fastpath_gen[dir]) == gen ||
+	    !(IPCB(skb)->flags & IPSKB_FORWARDED) ||
+	    ct->proto.tcp.state != TCP_CONNTRACK_ESTABLISHED)
+		return;
+
+	WRITE_ONCE(dext->fastpath_gen[dir], gen);
+}
+
+/* Client packets before the FORWARD chains drop them: the first ACK of a
+ * connection confirmed on its SYN, the first segment seen in progress, and
+ * the retransmission of that segment once the connection is allowed.
+ */
+static void synproxy_latency_observe(struct net *net, struct sk_buff *skb,
+				     struct synproxy_dpi_ext *dext, u32 state)
+{
+	struct tcphdr *th, _th;
+	unsigned int thoff, len;
+	u32 now, seq;
+
+	if (state == SYNPROXY_FINISH &&
+	    (!READ_ONCE(dext->tstamp_data) || READ_ONCE(dext->tstamp_retrans)))
+		return;
+
+	thoff = ip_hdrlen(skb);
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL || th->syn || th->rst || !th->ack)
+		return;
+	len = skb->len - thoff - th->doff * 4;
+	seq = ntohl(th->seq);
+	now = synproxy_dpi_now();
+
+	if (state == SYNPROXY_FINISH) {
+		if (len == 0 || seq != READ_ONCE(dext->data_seq))
+			return;
+		WRITE_ONCE(dext->tstamp_retrans, now);
+		synproxy_latency_add(net, SYNPROXY_LAT_RETRANS,
+				     READ_ONCE(dext->tstamp_data), now);
+		return;
+	}
+
+	if (!READ_ONCE(dext->tstamp_client_ack)) {
+		WRITE_ONCE(dext->tstamp_client_ack, now);
+		synproxy_latency_add(net, SYNPROXY_LAT_CLIENT_ACK,
+				     dext->tstamp_start, now);
+	}
+
+	if (len && !READ_ONCE(dext->tstamp_data)) {
+		WRITE_ONCE(dext->data_seq, seq);
+		smp_wmb();
+		WRITE_ONCE(dext->tstamp_data, now);
+	}
+}
+
+/* Keep the first client ACK of a connection in progress, a verdict out of
+ * band starts the server handshake with it instead of waiting for the client
+ * to retransmit.
+ */
+static void synproxy_dpi_record(struct sk_buff *skb, struct nf_conn *ct,
+				struct synproxy_dpi_ext *dext)
+{
+	struct synproxy_options opts = {};
+	struct tcphdr *th, _th;
+	unsigned int thoff;
+
+	if (READ_ONCE(dext->flags) & SYNPROXY_F_CLIENT)
+		return;
+
+	thoff = ip_hdrlen(skb);
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL || th->syn || th->fin || th->rst || !th->ack)
+		return;
+	if (!synproxy_parse_options(skb, thoff, th, &opts))
+		return;
+
+	spin_lock_bh(&ct->lock);
+	if (!(dext->flags & SYNPROXY_F_CLIENT)) {
+		dext->client_seq = ntohl(th->seq);
+		dext->client_ack_seq = ntohl(th->ack_seq);
+		dext->client_window = th->window;
+		dext->client_opts = opts;
+		dext->flags |= SYNPROXY_F_CLIENT;
+	}
+	spin_unlock_bh(&ct->lock);
+}
+
+/* DPI is done with the connection, the rule set stops queueing it. A
+ * verdict already recorded is kept.
+ */
+static void synproxy_dpi_done(struct nf_conn *ct, struct synproxy_dpi_ext *dext,
+			      u32 mark)
+{
+	spin_lock_bh(&ct->lock);
+	if (mark)
+		WRITE_ONCE(dext->verdict, mark);
+	WRITE_ONCE(dext->flags, dext->flags | SYNPROXY_F_DONE);
+	spin_unlock_bh(&ct->lock);
+}
+
+/* DPI gives up on a connection it could not classify in the first packets.
+ * Both directions update the counters without a lock, the limits are not
+ * exact.
+ */
+static void synproxy_dpi_account(struct nf_conn *ct,
+				 struct synproxy_dpi_ext *dext,
+				 const struct sk_buff *skb)
+{
+	u32 packets = READ_ONCE(dext->dpi_packets) + 1;
+	u32 bytes = READ_ONCE(dext->dpi_bytes) + skb->len;
+
+	WRITE_ONCE(dext->dpi_packets, packets);
+	WRITE_ONCE(dext->dpi_bytes, bytes);
+	if ((dpi_max_packets && packets >= dpi_max_packets) ||
+	    (dpi_max_bytes && bytes >= dpi_max_bytes))
+		synproxy_dpi_done(ct, dext, 0);
+}
+
+/* Packets of a connection DPI is done with get its verdict as their mark,
+ * the ruleset handles them as if DPI had marked them.
+ */
+static unsigned int ipv4_synproxy_forward_hook(void *priv,
+					       struct sk_buff *skb,
+					       const struct nf_hook_state *nhs)
+{
+	struct synproxy_dpi_ext *dext;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	u32 state;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || nf_ct_protonum(ct) != IPPROTO_TCP)
+		return NF_ACCEPT;
+
+	dext = synproxy_dpi_ext(ct);
+	state = synproxy_state(dext);
+	if (!state)
+		return NF_ACCEPT;
+
+	if (CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL) {
+		synproxy_latency_observe(nhs->net, skb, dext, state);
+		if (state == SYNPROXY_IN_PROGRESS)
+			synproxy_dpi_record(skb, ct, dext);
+	}
+	if (!(READ_ONCE(dext->flags) & SYNPROXY_F_DONE))
+		synproxy_dpi_account(ct, dext, skb);
+	else if (READ_ONCE(dext->verdict))
+		skb->mark = READ_ONCE(dext->verdict);
+	return NF_ACCEPT;
+}
+
+/* Runs once the mangle table is done with a packet. Packets DPI returned
+ * with the done bits are recorded before the filter table sees them.
+ * Established packets of a connection the ruleset already accepted skip the
+ * filter and security FORWARD chains, packets changing the TCP state go the
+ * full way.
+ */
+static unsigned int ipv4_synproxy_forward_late_hook(void *priv,
+						    struct sk_buff *skb,
+						    const struct nf_hook_state *nhs)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(nhs->net);
+	struct synproxy_dpi_ext *dext;
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct tcphdr *th, _th;
+	u32 state, gen;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL || nf_ct_protonum(ct) != IPPROTO_TCP)
+		return NF_ACCEPT;
+
+	dext = synproxy_dpi_ext(ct);
+	state = synproxy_state(dext);
+	if (state && (skb->mark & dpi_done_mark) &&
+	    !(READ_ONCE(dext->flags) & SYNPROXY_F_DONE))
+		synproxy_dpi_done(ct, dext, synproxy_l7_mark(skb));
+
+	if (!READ_ONCE(fastpath) || state != SYNPROXY_FINISH ||
+	    ct->proto.tcp.state != TCP_CONNTRACK_ESTABLISHED)
+		return NF_ACCEPT;
+
+	gen = synproxy_fastpath_gen(nhs->net);
+	if (gen == 0 || READ_ONCE(dext->fastpath_gen[CTINFO2DIR(ctinfo)]) != gen)
+		return NF_ACCEPT;
+
+	th = skb_header_pointer(skb, ip_hdrlen(skb), sizeof(_th), &_th);
+	if (th == NULL || th->syn || th->fin || th->rst)
+		return NF_ACCEPT;
+
+	this_cpu_inc(dnet->stats->fastpath);
+	return NF_STOP;
+}
+
+static inline void synproxy_seqadj_init(struct nf_conn *ct,
+					enum ip_conntrack_info ctinfo, s32 off)
+{
+	trace_synproxy_seqadj_init(ct, off);
+	nf_ct_seqadj_init(ct, ctinfo, off);
+}
+
+/* Translate the timestamp option between the views of the client and the
+ * server. Only the TCP header is made writable, a GSO packet is adjusted as
+ * a whole: its segments get copies of the header, and with CHECKSUM_PARTIAL
+ * the checksum is completed per segment after the change.
+ */
+static void
+synproxy_dpi_tstamp_adjust(struct sk_buff *skb, unsigned int protoff,
+			   unsigned int thlen, enum ip_conntrack_info ctinfo,
+			   const struct nf_conn_synproxy *synproxy)
+{
+	unsigned int optoff, optend = protoff + thlen;
+	struct tcphdr *th;
+	__be32 *ptr, old;
+	u8 *op;
+
+	if (synproxy->tsoff == 0)
+		return;
+
+	/* May move the header, nothing may point into it before. */
+	if (!skb_make_writable(skb, optend))
+		return;
+	th = (struct tcphdr *)(skb->data + protoff);
+
+	optoff = protoff + sizeof(*th);
+	while (optoff < optend) {
+		op = skb->data + optoff;
+
+		switch (op[0]) {
+		case TCPOPT_EOL:
+			return;
+		case TCPOPT_NOP:
+			optoff++;
+			continue;
+		}
+
+		if (optoff + 1 == optend || op[1] < 2 || optoff + op[1] > optend)
+			return;
+
+		if (op[0] == TCPOPT_TIMESTAMP && op[1] == TCPOLEN_TIMESTAMP) {
+			if (CTINFO2DIR(ctinfo) == IP_CT_DIR_REPLY) {
+				ptr = (__be32 *)&op[2];
+				old = *ptr;
+				*ptr = htonl(ntohl(old) - synproxy->tsoff);
+			} else {
+				ptr = (__be32 *)&op[6];
+				old = *ptr;
+				*ptr = htonl(ntohl(old) + synproxy->tsoff);
+			}
+			inet_proto_csum_replace4(&th->check, skb, old, *ptr, false);
+			return;
+		}
+		optoff += op[1];
+	}
+}
+
+static unsigned int ipv4_synproxy_hook(void *priv,
+				       struct sk_buff *skb,
+				       const struct nf_hook_state *nhs)
+{
+	struct synproxy_net *snet = synproxy_pernet(nhs->net);
+	enum ip_conntrack_info ctinfo;
+	struct nf_conn *ct;
+	struct nf_conn_synproxy *synproxy;
+	struct synproxy_dpi_ext *dext;
+	struct synproxy_options opts = {};
+	const struct ip_ct_tcp *state;
+	struct tcphdr *th, _th;
+	unsigned int thoff, verdict;
+	u32 dstate;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (ct == NULL)
+		return NF_ACCEPT;
+
+	dext = synproxy_dpi_ext(ct);
+	dstate = synproxy_state(dext);
+	if (dstate == SYNPROXY_FINISH && fastpath &&
+	    nhs->hook == NF_INET_POST_ROUTING)
+		synproxy_fastpath_learn(nhs->net, skb, ct, ctinfo, dext);
+
+	if (dstate == SYNPROXY_IN_PROGRESS || synproxy_is_speculative(dstate)) {
+		verdict = synproxy_in_progress_hook(nhs, skb, ct, dext, ctinfo);
+		if (verdict != NF_ACCEPT)
+			return verdict;
+	}
+
+	/* The extension exists from the client handshake on, the server
+	 * side is only handled here once its SYN was sent.
+	 */
+	synproxy = nfct_synproxy(ct);
+	if (synproxy == NULL || (dext && !(dext->flags & SYNPROXY_F_SERVER)))
+		return NF_ACCEPT;
+
+	if (nf_is_loopback_packet(skb))
+		return NF_ACCEPT;
+
+	thoff = ip_hdrlen(skb);
+	th = skb_header_pointer(skb, thoff, sizeof(_th), &_th);
+	if (th == NULL)
+		return NF_DROP;
+
+	state = &ct->proto.tcp;
+	switch (state->state) {
+	case TCP_CONNTRACK_CLOSE:
+		if (th->rst && !test_bit(IPS_SEEN_REPLY_BIT, &ct->status)) {
+			synproxy_seqadj_init(ct, ctinfo, synproxy->isn -
+							 ntohl(th->seq) + 1);
+			break;
+		}
+
+		if (!th->syn || th->ack ||
+		    CTINFO2DIR(ctinfo) != IP_CT_DIR_ORIGINAL)
+			break;
+
+		/* Reopened connection - reset the sequence number and timestamp
+		 * adjustments, they will get initialized once the connection is
+		 * reestablished.
+		 */
+		synproxy_seqadj_init(ct, ctinfo, 0);
+		synproxy->tsoff = 0;
+		this_cpu_inc(snet->stats->conn_reopened);
+
+		/* fall through */
+	case TCP_CONNTRACK_SYN_SENT:
+		if (!synproxy_parse_options(skb, thoff, th, &opts))
+			return NF_DROP;
+
+		if (!th->syn && th->ack &&
+		    CTINFO2DIR(ctinfo) == IP_CT_DIR_ORIGINAL) {
+			/* Keep-Alives are sent with SEG.SEQ = SND.NXT-1,
+			 * therefore we need to add 1 to make the SYN sequence
+			 * number match the one of first SYN.
+			 */
+			if (synproxy_recv_client_ack(snet, skb, th, &opts,
+						     ntohl(th->seq) + 1))
+				this_cpu_inc(snet->stats->cookie_retrans);
+
+			return NF_DROP;
+		}
+
+		synproxy->isn = ntohl(th->ack_seq);
+		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
+			synproxy->its = opts.tsecr;
+		break;
+	case TCP_CONNTRACK_SYN_RECV:
+		if (!th->syn || !th->ack)
+			break;
+
+		trace_synproxy_server_synack_recv(ip_hdr(skb), th);
+
+		if (!synproxy_parse_options(skb, thoff, th, &opts))
+			return NF_DROP;
+
+		if (opts.options & XT_SYNPROXY_OPT_TIMESTAMP)
+			synproxy->tsoff = opts.tsval - synproxy->its;
+
+		opts.options &= ~(XT_SYNPROXY_OPT_MSS |
+				  XT_SYNPROXY_OPT_WSCALE |
+				  XT_SYNPROXY_OPT_SACK_PERM);
+
+		swap(opts.tsval, opts.tsecr);
+		synproxy_send_server_ack(snet, state, skb, th, &opts);
+
+		synproxy_seqadj_init(ct, ctinfo, synproxy->isn - ntohl(th->seq));
+
+		/* A speculative server half waits for the verdict, or is
+		 * reset if DPI denied the connection meanwhile.
+		 */
+		switch (synproxy_speculative_open(ct)) {
+		case SYNPROXY_IN_PROGRESS:
+			synproxy_send_server_rst(snet, skb, ct, ntohl(th->ack_seq));
+			/* fall through */
+		case SYNPROXY_SPECULATIVE_OPEN:
+			consume_skb(skb);
+			return NF_STOLEN;
+		}
+
+		synproxy_stash_replay(nhs->net, ct);
+
+		swap(opts.tsval, opts.tsecr);
+		synproxy_send_client_ack(snet, skb, th, &opts);
+
+		consume_skb(skb);
+		return NF_STOLEN;
+	default:
+		break;
+	}
+
+	synproxy_dpi_tstamp_adjust(skb, thoff, th->doff * 4, ctinfo, synproxy);
+	return NF_ACCEPT;
+}
+
+static int synproxy_tg4_check(const struct xt_tgchk_param *par)
+{
+	const struct ipt_entry *e = par->entryinfo;
+
+	if (e->ip.proto != IPPROTO_TCP ||
+	    e->ip.invflags & XT_INV_PROTO)
+		return -EINVAL;
+
+	return nf_ct_l3proto_try_module_get(par->family);
+}
+
+static void synproxy_tg4_destroy(const struct xt_tgdtor_param *par)
+{
+	nf_ct_l3proto_module_put(par->family);
+}
+
+static struct xt_target synproxy_tg4_reg __read_mostly = {
+	.name		= "SYNPROXY",
+	.family		= NFPROTO_IPV4,
 	.hooks		= (1 << NF_INET_LOCAL_IN) | (1 << NF_INET_FORWARD),
 	.target		= synproxy_tg4,
 	.targetsize	= sizeof(struct xt_synproxy_info),
@@ -520,104 +3183,940 @@ static struct xt_target synproxy_tg4_reg __read_mostly = {
 	.me		= THIS_MODULE,
 };
 
-static struct nf_hook_ops ipv4_synproxy_ops[] __read_mostly = {
-	{
-		.hook		= ipv4_synproxy_hook,
-		.pf		= NFPROTO_IPV4,
-		.hooknum	= NF_INET_LOCAL_IN,
-		.priority	= NF_IP_PRI_CONNTRACK_CONFIRM - 1,
-	},
+static struct nf_hook_ops ipv4_synproxy_ops[] __read_mostly = {
+	{
+		.hook		= ipv4_synproxy_hook,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_LOCAL_IN,
+		.priority	= NF_IP_PRI_CONNTRACK_CONFIRM - 1,
+	},
+	{
+		.hook		= ipv4_synproxy_hook,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_POST_ROUTING,
+		.priority	= NF_IP_PRI_CONNTRACK_CONFIRM - 1,
+	},
+	{
+		.hook		= ipv4_synproxy_forward_hook,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_FORWARD,
+		.priority	= NF_IP_PRI_MANGLE - 1,
+	},
+	{
+		.hook		= ipv4_synproxy_forward_late_hook,
+		.pf		= NFPROTO_IPV4,
+		.hooknum	= NF_INET_FORWARD,
+		.priority	= NF_IP_PRI_MANGLE + 1,
+	},
+};
+
+#define XT_SPSTATE_NONE 0
+#define XT_SPSTATE_IN_PROGRESS 1
+#define XT_SPSTATE_FINISH 2
+#define XT_SPSTATE_DONE 3
+
+struct xt_spstate_mtinfo {
+	uint8_t state;
+	uint8_t invert;
+};
+
+#define XT_SPSTATE_MARKS_MAX 256
+#define XT_SPSTATE_F_MARKS 0x01
+
+/* Revision 1 can also require the packet mark to be one of a set of L7
+ * marks, so a single rule covers the whole DPI policy.
+ */
+struct xt_spstate_mtinfo_v1 {
+	uint8_t state;
+	uint8_t invert;
+	uint8_t flags;
+	uint8_t pad;
+	uint32_t marks[XT_SPSTATE_MARKS_MAX / 32];
+};
+
+static bool spstate_mt_state(const struct sk_buff *skb,
+			     const struct xt_spstate_mtinfo *info)
+{
+	enum ip_conntrack_info ctinfo;
+	struct synproxy_dpi_ext *dext;
+	struct nf_conn *ct;
+	bool result = false;
+	u32 state;
+
+	ct = nf_ct_get(skb, &ctinfo);
+	if (!ct)
+		return true;
+	dext = synproxy_dpi_ext(ct);
+	state = synproxy_state(dext);
+
+	switch (info->state) {
+		case XT_SPSTATE_NONE:
+			result = state == 0;
+			break;
+		case XT_SPSTATE_IN_PROGRESS:
+			result = state == SYNPROXY_IN_PROGRESS ||
+				 synproxy_is_speculative(state);
+			break;
+		case XT_SPSTATE_FINISH:
+			result = state == SYNPROXY_FINISH;
+			break;
+		case XT_SPSTATE_DONE:
+			result = state && (READ_ONCE(dext->flags) & SYNPROXY_F_DONE);
+			break;
+		default:
+			return false;
+	}
+
+	if (info->invert) {
+		result = !result;
+	}
+
+	return result;
+}
+
+static bool spstate_mt(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	return spstate_mt_state(skb, par->matchinfo);
+}
+
+static bool spstate_mt_v1(const struct sk_buff *skb, struct xt_action_param *par)
+{
+	const struct xt_spstate_mtinfo_v1 *info = par->matchinfo;
+	const struct xt_spstate_mtinfo state = {
+		.state	= info->state,
+		.invert	= info->invert,
+	};
+
+	if (!spstate_mt_state(skb, &state))
+		return false;
+
+	if (info->flags & XT_SPSTATE_F_MARKS) {
+		u32 mark = synproxy_l7_mark(skb);
+
+		return mark < XT_SPSTATE_MARKS_MAX &&
+		       info->marks[mark / 32] & (1U << (mark % 32));
+	}
+
+	return true;
+}
+
+static int spstate_mt_check_v1(const struct xt_mtchk_param *par)
+{
+	const struct xt_spstate_mtinfo_v1 *info = par->matchinfo;
+
+	if (info->flags & ~XT_SPSTATE_F_MARKS)
+		return -EINVAL;
+
+	return 0;
+}
+
+static struct xt_match spstate_mt_reg[] __read_mostly = {
+	{
+		.name             = "spstate",
+		.revision         = 0,
+		.family           = NFPROTO_IPV4,
+		.match            = spstate_mt,
+		.matchsize        = sizeof(struct xt_spstate_mtinfo),
+		.me               = THIS_MODULE,
+	},
+	{
+		.name             = "spstate",
+		.revision         = 1,
+		.family           = NFPROTO_IPV4,
+		.match            = spstate_mt_v1,
+		.checkentry       = spstate_mt_check_v1,
+		.matchsize        = sizeof(struct xt_spstate_mtinfo_v1),
+		.me               = THIS_MODULE,
+	},
+};
+
+/* Generic netlink family DPI sends verdicts through when it releases queued
+ * packets right away instead of returning the verdict with them. A verdict
+ * names the connection by the addresses and ports of a client packet as DPI
+ * saw it in FORWARD.
+ */
+#define SYNPROXY_DPI_GENL_NAME		"SYNPROXY_DPI"
+#define SYNPROXY_DPI_GENL_VERSION	1
+
+enum {
+	SYNPROXY_DPI_CMD_UNSPEC,
+	SYNPROXY_DPI_CMD_VERDICT,
+};
+
+enum {
+	SYNPROXY_DPI_A_UNSPEC,
+	SYNPROXY_DPI_A_SADDR,		/* be32 */
+	SYNPROXY_DPI_A_DADDR,		/* be32 */
+	SYNPROXY_DPI_A_SPORT,		/* be16 */
+	SYNPROXY_DPI_A_DPORT,		/* be16 */
+	SYNPROXY_DPI_A_MARK,		/* u32, the L7 mark */
+	SYNPROXY_DPI_A_FLAGS,		/* u32 */
+	SYNPROXY_DPI_A_ZONE,		/* u16, the conntrack zone */
+	__SYNPROXY_DPI_A_MAX,
+};
+#define SYNPROXY_DPI_A_MAX (__SYNPROXY_DPI_A_MAX - 1)
+
+/* The mark allows the connection, start the server handshake now */
+#define SYNPROXY_DPI_F_START	0x01
+
+static const struct nla_policy synproxy_dpi_genl_policy[SYNPROXY_DPI_A_MAX + 1] = {
+	[SYNPROXY_DPI_A_SADDR]	= { .type = NLA_U32 },
+	[SYNPROXY_DPI_A_DADDR]	= { .type = NLA_U32 },
+	[SYNPROXY_DPI_A_SPORT]	= { .type = NLA_U16 },
+	[SYNPROXY_DPI_A_DPORT]	= { .type = NLA_U16 },
+	[SYNPROXY_DPI_A_MARK]	= { .type = NLA_U32 },
+	[SYNPROXY_DPI_A_FLAGS]	= { .type = NLA_U32 },
+	[SYNPROXY_DPI_A_ZONE]	= { .type = NLA_U16 },
+};
+
+/* Connections in progress are found by their addresses in FORWARD under any
+ * NAT. Others are only looked up to count the verdict: without NAT the
+ * addresses are those of the original tuple, with DNAT the inverted ones are
+ * the reply tuple.
+ */
+static struct nf_conn *synproxy_dpi_genl_find(struct net *net,
+					      struct nlattr **attrs)
+{
+	struct nf_conntrack_tuple_hash *h;
+	struct nf_conntrack_tuple tuple;
+	struct nf_conntrack_zone zone;
+	struct nf_conn *ct;
+	u16 zone_id = NF_CT_DEFAULT_ZONE_ID;
+
+	memset(&tuple, 0, sizeof(tuple));
+	tuple.src.l3num = AF_INET;
+	tuple.src.u3.ip = nla_get_in_addr(attrs[SYNPROXY_DPI_A_SADDR]);
+	tuple.src.u.tcp.port = nla_get_be16(attrs[SYNPROXY_DPI_A_SPORT]);
+	tuple.dst.u3.ip = nla_get_in_addr(attrs[SYNPROXY_DPI_A_DADDR]);
+	tuple.dst.u.tcp.port = nla_get_be16(attrs[SYNPROXY_DPI_A_DPORT]);
+	tuple.dst.protonum = IPPROTO_TCP;
+
+	if (attrs[SYNPROXY_DPI_A_ZONE])
+		zone_id = nla_get_u16(attrs[SYNPROXY_DPI_A_ZONE]);
+	nf_ct_zone_init(&zone, zone_id, NF_CT_DEFAULT_ZONE_DIR, 0);
+
+	ct = synproxy_inprog_find(net, &zone, &tuple);
+	if (ct != NULL)
+		return ct;
+
+	h = nf_conntrack_find_get(net, &zone, &tuple);
+	if (h == NULL) {
+		swap(tuple.src.u3.ip, tuple.dst.u3.ip);
+		swap(tuple.src.u.tcp.port, tuple.dst.u.tcp.port);
+		h = nf_conntrack_find_get(net, &zone, &tuple);
+	}
+
+	return h ? nf_ct_tuplehash_to_ctrack(h) : NULL;
+}
+
+/* Rebuild the client ACK recorded in FORWARD and let it take the path of an
+ * allowed ACK through the SYNPROXY target.
+ */
+static void synproxy_dpi_start(struct net *net, struct nf_conn *ct,
+			       struct synproxy_dpi_ext *dext, u32 mark)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_net *snet = synproxy_pernet(net);
+	struct synproxy_options opts;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	struct tcphdr *th;
+	bool start;
+	u32 isn;
+
+	skb = alloc_skb(sizeof(*iph) + sizeof(*th), GFP_KERNEL);
+	if (skb == NULL)
+		return;
+
+	skb_reset_network_header(skb);
+	iph = (struct iphdr *)skb_put(skb, sizeof(*iph));
+	memset(iph, 0, sizeof(*iph));
+	iph->version	= 4;
+	iph->ihl	= sizeof(*iph) / 4;
+	iph->tot_len	= htons(sizeof(*iph) + sizeof(*th));
+	iph->protocol	= IPPROTO_TCP;
+	iph->saddr	= ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u3.ip;
+	iph->daddr	= ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u3.ip;
+
+	skb_set_transport_header(skb, sizeof(*iph));
+	th = (struct tcphdr *)skb_put(skb, sizeof(*th));
+	memset(th, 0, sizeof(*th));
+	th->source	= ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple.src.u.tcp.port;
+	th->dest	= ct->tuplehash[IP_CT_DIR_REPLY].tuple.src.u.tcp.port;
+	th->doff	= sizeof(*th) / 4;
+	th->ack		= 1;
+
+	spin_lock_bh(&ct->lock);
+	th->seq		= htonl(dext->client_seq);
+	th->ack_seq	= htonl(dext->client_ack_seq);
+	th->window	= dext->client_window;
+	opts		= dext->client_opts;
+	spin_unlock_bh(&ct->lock);
+
+	nf_conntrack_get(&ct->ct_general);
+	skb->nfct = &ct->ct_general;
+	skb->nfctinfo = IP_CT_ESTABLISHED;
+
+	local_bh_disable();
+	if (rx_max_bytes && synproxy_stash_isn(ct, &isn))
+		th->seq = htonl(isn + 1);
+
+	if (!synproxy_check_client_cookie(snet, skb, th, &opts))
+		goto out;
+
+	/* A client packet marked with the verdict may have beaten us */
+	spin_lock(&ct->lock);
+	start = dext->state == SYNPROXY_IN_PROGRESS;
+	if (start)
+		synproxy_dpi_finish(ct, dext, mark);
+	spin_unlock(&ct->lock);
+	if (!start)
+		goto out;
+
+	synproxy_inprog_release(net, ct, dext);
+	synproxy_verdict_update(net, iph->daddr, th->dest, mark);
+	this_cpu_inc(dnet->stats->oob_start);
+	synproxy_send_server_syn(snet, skb, th, &opts, ntohl(th->seq));
+out:
+	local_bh_enable();
+	kfree_skb(skb);
+}
+
+static int synproxy_dpi_genl_verdict(struct sk_buff *skb,
+				     struct genl_info *info)
+{
+	struct net *net = genl_info_net(info);
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct nlattr **attrs = info->attrs;
+	struct synproxy_dpi_ext *dext;
+	struct nf_conn *ct;
+	u32 mark, flags = 0, state = 0;
+
+	if (!attrs[SYNPROXY_DPI_A_SADDR] || !attrs[SYNPROXY_DPI_A_DADDR] ||
+	    !attrs[SYNPROXY_DPI_A_SPORT] || !attrs[SYNPROXY_DPI_A_DPORT] ||
+	    !attrs[SYNPROXY_DPI_A_MARK])
+		return -EINVAL;
+
+	mark = nla_get_u32(attrs[SYNPROXY_DPI_A_MARK]) & ~dpi_done_mark;
+	if (attrs[SYNPROXY_DPI_A_FLAGS])
+		flags = nla_get_u32(attrs[SYNPROXY_DPI_A_FLAGS]);
+
+	/* A connection that is gone or already decided is not an error, the
+	 * verdict simply came too late.
+	 */
+	ct = synproxy_dpi_genl_find(net, attrs);
+	if (ct == NULL) {
+		this_cpu_inc(dnet->stats->oob_miss);
+		return 0;
+	}
+
+	dext = synproxy_dpi_ext(ct);
+	if (dext) {
+		spin_lock_bh(&ct->lock);
+		state = dext->state;
+		if (state == SYNPROXY_IN_PROGRESS ||
+		    synproxy_is_speculative(state)) {
+			WRITE_ONCE(dext->verdict, mark);
+			WRITE_ONCE(dext->flags, dext->flags | SYNPROXY_F_DONE);
+		}
+		spin_unlock_bh(&ct->lock);
+	}
+
+	if (state == SYNPROXY_IN_PROGRESS || synproxy_is_speculative(state)) {
+		this_cpu_inc(dnet->stats->oob_verdict);
+		/* A speculative connection is completed by its next client
+		 * packet, which now carries the verdict.
+		 */
+		if (state == SYNPROXY_IN_PROGRESS && mark &&
+		    (flags & SYNPROXY_DPI_F_START) &&
+		    (READ_ONCE(dext->flags) & SYNPROXY_F_CLIENT))
+			synproxy_dpi_start(net, ct, dext, mark);
+	} else {
+		this_cpu_inc(dnet->stats->oob_miss);
+	}
+
+	nf_ct_put(ct);
+	return 0;
+}
+
+static const struct genl_ops synproxy_dpi_genl_ops[] = {
 	{
-		.hook		= ipv4_synproxy_hook,
-		.pf		= NFPROTO_IPV4,
-		.hooknum	= NF_INET_POST_ROUTING,
-		.priority	= NF_IP_PRI_CONNTRACK_CONFIRM - 1,
+		.cmd		= SYNPROXY_DPI_CMD_VERDICT,
+		.doit		= synproxy_dpi_genl_verdict,
+		.policy		= synproxy_dpi_genl_policy,
+		.flags		= GENL_ADMIN_PERM,
 	},
 };
 
-#define XT_SPSTATE_NONE 0
-#define XT_SPSTATE_IN_PROGRESS 1
-#define XT_SPSTATE_FINISH 2
+static struct genl_family synproxy_dpi_genl_family = {
+	.id		= GENL_ID_GENERATE,
+	.name		= SYNPROXY_DPI_GENL_NAME,
+	.version	= SYNPROXY_DPI_GENL_VERSION,
+	.maxattr	= SYNPROXY_DPI_A_MAX,
+	.netnsok	= true,
+};
 
-struct xt_spstate_mtinfo {
-	uint8_t state;
-	uint8_t invert;
+#ifdef CONFIG_PROC_FS
+static void *synproxy_dpi_cpu_seq_start(struct seq_file *seq, loff_t *pos)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(seq_file_net(seq));
+	int cpu;
+
+	if (*pos == 0)
+		return SEQ_START_TOKEN;
+
+	for (cpu = *pos - 1; cpu < nr_cpu_ids; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		*pos = cpu + 1;
+		return per_cpu_ptr(dnet->stats, cpu);
+	}
+
+	return NULL;
+}
+
+static void *synproxy_dpi_cpu_seq_next(struct seq_file *seq, void *v,
+				       loff_t *pos)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(seq_file_net(seq));
+	int cpu;
+
+	for (cpu = *pos; cpu < nr_cpu_ids; cpu++) {
+		if (!cpu_possible(cpu))
+			continue;
+		*pos = cpu + 1;
+		return per_cpu_ptr(dnet->stats, cpu);
+	}
+
+	return NULL;
+}
+
+static void synproxy_dpi_cpu_seq_stop(struct seq_file *seq, void *v)
+{
+	return;
+}
+
+static int synproxy_dpi_cpu_seq_show(struct seq_file *seq, void *v)
+{
+	struct synproxy_dpi_stats *stats = v;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_printf(seq, "stash_stored\tstash_replayed\t"
+				"stash_evicted\tstash_expired\t"
+				"stash_full\tverdict_hit\t"
+				"verdict_miss\tverdict_stored\t"
+				"verdict_evicted\tin_progress_evicted\t"
+				"in_progress_limit\troute_hit\t"
+				"route_miss\tfastpath\t"
+				"server_syn_retrans\toob_verdict\t"
+				"oob_start\toob_miss\n");
+		return 0;
+	}
+
+	seq_printf(seq, "%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t"
+			"%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\t%08x\n",
+		   stats->stash_stored,
+		   stats->stash_replayed,
+		   stats->stash_evicted,
+		   stats->stash_expired,
+		   stats->stash_full,
+		   stats->verdict_hit,
+		   stats->verdict_miss,
+		   stats->verdict_stored,
+		   stats->verdict_evicted,
+		   stats->in_progress_evicted,
+		   stats->in_progress_limit,
+		   stats->route_hit,
+		   stats->route_miss,
+		   stats->fastpath,
+		   stats->server_syn_retrans,
+		   stats->oob_verdict,
+		   stats->oob_start,
+		   stats->oob_miss);
+
+	return 0;
+}
+
+static const struct seq_operations synproxy_dpi_cpu_seq_ops = {
+	.start		= synproxy_dpi_cpu_seq_start,
+	.next		= synproxy_dpi_cpu_seq_next,
+	.stop		= synproxy_dpi_cpu_seq_stop,
+	.show		= synproxy_dpi_cpu_seq_show,
 };
 
-static bool spstate_mt(const struct sk_buff *skb, struct xt_action_param *par)
+static int synproxy_dpi_cpu_seq_open(struct inode *inode, struct file *file)
 {
-	const struct xt_spstate_mtinfo *info = par->matchinfo;
-	enum ip_conntrack_info ctinfo;
-	struct nf_conn *ct;
-	bool result = false;
+	return seq_open_net(inode, file, &synproxy_dpi_cpu_seq_ops,
+			    sizeof(struct seq_net_private));
+}
 
-	ct = nf_ct_get(skb, &ctinfo);
-	if (!ct)
-		return true;
+static const struct file_operations synproxy_dpi_cpu_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= synproxy_dpi_cpu_seq_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= seq_release_net,
+};
 
-	switch (info->state) {
-		case XT_SPSTATE_NONE:
-			result = ct->mark == 0;
-			break;
-		case XT_SPSTATE_IN_PROGRESS:
-			result = ct->mark == SYNPROXY_IN_PROGRESS;
-			break;
-		case XT_SPSTATE_FINISH:
-			result = ct->mark == SYNPROXY_FINISH;
-			break;
-		default:
-			return false;
+static int synproxy_verdict_seq_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq->private;
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_verdict *verdict;
+	unsigned long timeout;
+	int i;
+
+	seq_puts(seq, "destination\tmark\ttimeout\n");
+
+	rcu_read_lock();
+	for (i = 0; i < ARRAY_SIZE(dnet->verdicts.hash); i++) {
+		hlist_for_each_entry_rcu(verdict, &dnet->verdicts.hash[i], hnode) {
+			timeout = READ_ONCE(verdict->timeout);
+			if (!time_before(jiffies, timeout))
+				continue;
+
+			seq_printf(seq, "%pI4:%u\t0x%x\t%u\n",
+				   &verdict->daddr, ntohs(verdict->dport),
+				   READ_ONCE(verdict->mark),
+				   jiffies_to_msecs(timeout - jiffies) / 1000);
+		}
 	}
+	rcu_read_unlock();
 
-	if (info->invert) {
-		result = !result;
+	return 0;
+}
+
+static int synproxy_verdict_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, synproxy_verdict_seq_show);
+}
+
+/* Writing "flush" drops all cached verdicts. */
+static ssize_t synproxy_verdict_seq_write(struct file *file,
+					  const char __user *ubuf,
+					  size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct net *net = seq->private;
+	char buf[16];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (strcmp(strim(buf), "flush"))
+		return -EINVAL;
+
+	synproxy_verdict_flush(synproxy_dpi_pernet(net));
+	return count;
+}
+
+static const struct file_operations synproxy_verdict_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= synproxy_verdict_seq_open,
+	.read		= seq_read,
+	.write		= synproxy_verdict_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release_net,
+};
+
+static int synproxy_fastpath_seq_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq->private;
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+
+	seq_printf(seq, "generation\t%u\n", atomic_read(&dnet->fastpath_gen));
+	return 0;
+}
+
+static int synproxy_fastpath_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, synproxy_fastpath_seq_show);
+}
+
+/* Writing "flush" sends all connections through the ruleset again. */
+static ssize_t synproxy_fastpath_seq_write(struct file *file,
+					   const char __user *ubuf,
+					   size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct net *net = seq->private;
+	char buf[16];
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (strcmp(strim(buf), "flush"))
+		return -EINVAL;
+
+	synproxy_fastpath_flush(net);
+	return count;
+}
+
+static const struct file_operations synproxy_fastpath_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= synproxy_fastpath_seq_open,
+	.read		= seq_read,
+	.write		= synproxy_fastpath_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release_net,
+};
+
+static const char *const synproxy_lat_names[SYNPROXY_LAT_MAX] = {
+	[SYNPROXY_LAT_CLIENT_ACK]	= "client_ack",
+	[SYNPROXY_LAT_VERDICT]		= "verdict",
+	[SYNPROXY_LAT_SERVER_RTT]	= "server_rtt",
+	[SYNPROXY_LAT_RETRANS]		= "retrans",
+};
+
+static int synproxy_latency_seq_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq->private;
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	const struct synproxy_latency *lat;
+	u64 sum[SYNPROXY_LAT_MAX];
+	int cpu, i, b;
+
+	seq_puts(seq, "usec");
+	for (i = 0; i < SYNPROXY_LAT_MAX; i++)
+		seq_printf(seq, "\t%s", synproxy_lat_names[i]);
+	seq_putc(seq, '\n');
+
+	for (b = 0; b < SYNPROXY_LAT_BUCKETS; b++) {
+		memset(sum, 0, sizeof(sum));
+		for_each_possible_cpu(cpu) {
+			lat = per_cpu_ptr(dnet->latency, cpu);
+			for (i = 0; i < SYNPROXY_LAT_MAX; i++)
+				sum[i] += lat->count[i][b];
+		}
+
+		seq_printf(seq, "%u", b ? 1U << (b - 1) : 0);
+		for (i = 0; i < SYNPROXY_LAT_MAX; i++)
+			seq_printf(seq, "\t%llu", sum[i]);
+		seq_putc(seq, '\n');
 	}
 
-	return result;
+	return 0;
+}
+
+static int synproxy_latency_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, synproxy_latency_seq_show);
+}
+
+/* Writing "reset" clears the histograms. Samples taken on other CPUs while
+ * they are cleared may survive, the hot path takes no lock.
+ */
+static ssize_t synproxy_latency_seq_write(struct file *file,
+					  const char __user *ubuf,
+					  size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct net *net = seq->private;
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	char buf[16];
+	int cpu;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	if (strcmp(strim(buf), "reset"))
+		return -EINVAL;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(dnet->latency, cpu), 0,
+		       sizeof(struct synproxy_latency));
+	return count;
 }
 
-static struct xt_match spstate_mt_reg __read_mostly = {
-	.name             = "spstate",
-	.revision         = 0,
-	.family           = NFPROTO_IPV4,
-	.match            = spstate_mt,
-	.matchsize        = sizeof(struct xt_spstate_mtinfo),
-	.me               = THIS_MODULE,
+static const struct file_operations synproxy_latency_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= synproxy_latency_seq_open,
+	.read		= seq_read,
+	.write		= synproxy_latency_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release_net,
 };
 
+static int synproxy_trusted_seq_show(struct seq_file *seq, void *v)
+{
+	struct net *net = seq->private;
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	struct synproxy_trusted_set *set;
+	int i;
+
+	seq_puts(seq, "set\thit\tabort\n");
+
+	mutex_lock(&synproxy_trusted_mutex);
+	for (i = 0; i < SYNPROXY_TRUSTED_MAX; i++) {
+		set = &dnet->trusted[i];
+		if (set->index == IPSET_INVALID_ID)
+			continue;
+
+		seq_printf(seq, "%s\t%u\t%u\n", set->name,
+			   atomic_read(&set->hit), atomic_read(&set->abort));
+	}
+	mutex_unlock(&synproxy_trusted_mutex);
+
+	return 0;
+}
+
+static int synproxy_trusted_seq_open(struct inode *inode, struct file *file)
+{
+	return single_open_net(inode, file, synproxy_trusted_seq_show);
+}
+
+/* Accepts "add <set>" and "del <set>". */
+static ssize_t synproxy_trusted_seq_write(struct file *file,
+					  const char __user *ubuf,
+					  size_t count, loff_t *ppos)
+{
+	struct seq_file *seq = file->private_data;
+	struct net *net = seq->private;
+	char buf[IPSET_MAXNAMELEN + 8], *cmd, *name;
+	int err;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+
+	name = strim(buf);
+	cmd = strsep(&name, " ");
+	if (name == NULL)
+		return -EINVAL;
+	name = strim(name);
+
+	if (!strcmp(cmd, "add"))
+		err = synproxy_trusted_add(net, name);
+	else if (!strcmp(cmd, "del"))
+		err = synproxy_trusted_del(net, name);
+	else
+		err = -EINVAL;
+
+	return err < 0 ? err : count;
+}
+
+static const struct file_operations synproxy_trusted_seq_fops = {
+	.owner		= THIS_MODULE,
+	.open		= synproxy_trusted_seq_open,
+	.read		= seq_read,
+	.write		= synproxy_trusted_seq_write,
+	.llseek		= seq_lseek,
+	.release	= single_release_net,
+};
+
+static int __net_init synproxy_dpi_proc_init(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+
+	if (!proc_create("synproxy_dpi", S_IRUGO, net->proc_net_stat,
+			 &synproxy_dpi_cpu_seq_fops))
+		goto err1;
+
+	dnet->proc_dir = proc_mkdir_data("synproxy_dpi", 0, net->proc_net, net);
+	if (!dnet->proc_dir)
+		goto err2;
+
+	if (!proc_create("verdict_cache", S_IRUGO | S_IWUSR, dnet->proc_dir,
+			 &synproxy_verdict_seq_fops))
+		goto err3;
+
+	if (!proc_create("trusted_sets", S_IRUGO | S_IWUSR, dnet->proc_dir,
+			 &synproxy_trusted_seq_fops))
+		goto err4;
+
+	if (!proc_create("fastpath", S_IRUGO | S_IWUSR, dnet->proc_dir,
+			 &synproxy_fastpath_seq_fops))
+		goto err5;
+
+	if (!proc_create("latency", S_IRUGO | S_IWUSR, dnet->proc_dir,
+			 &synproxy_latency_seq_fops))
+		goto err6;
+
+	return 0;
+
+err6:
+	remove_proc_entry("fastpath", dnet->proc_dir);
+err5:
+	remove_proc_entry("trusted_sets", dnet->proc_dir);
+err4:
+	remove_proc_entry("verdict_cache", dnet->proc_dir);
+err3:
+	remove_proc_entry("synproxy_dpi", net->proc_net);
+err2:
+	remove_proc_entry("synproxy_dpi", net->proc_net_stat);
+err1:
+	return -ENOMEM;
+}
+
+static void __net_exit synproxy_dpi_proc_exit(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+
+	remove_proc_entry("latency", dnet->proc_dir);
+	remove_proc_entry("fastpath", dnet->proc_dir);
+	remove_proc_entry("trusted_sets", dnet->proc_dir);
+	remove_proc_entry("verdict_cache", dnet->proc_dir);
+	remove_proc_entry("synproxy_dpi", net->proc_net);
+	remove_proc_entry("synproxy_dpi", net->proc_net_stat);
+}
+#else
+static int __net_init synproxy_dpi_proc_init(struct net *net)
+{
+	return 0;
+}
+
+static void __net_exit synproxy_dpi_proc_exit(struct net *net)
+{
+	return;
+}
+#endif /* CONFIG_PROC_FS */
+
+static int __net_init synproxy_dpi_net_init(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+	int err = -ENOMEM;
+
+	dnet->stats = alloc_percpu(struct synproxy_dpi_stats);
+	if (!dnet->stats)
+		goto err1;
+
+	dnet->latency = alloc_percpu(struct synproxy_latency);
+	if (!dnet->latency)
+		goto err2;
+
+	dnet->routes = alloc_percpu(struct synproxy_route_cache);
+	if (!dnet->routes)
+		goto err3;
+	synproxy_route_init(dnet);
+
+	synproxy_verdict_init(dnet);
+	synproxy_trusted_init(dnet);
+	synproxy_inprog_init(net);
+	atomic_set(&dnet->fastpath_gen, 1);
+
+	err = synproxy_dpi_proc_init(net);
+	if (err < 0)
+		goto err4;
+
+	return 0;
+
+err4:
+	free_percpu(dnet->routes);
+err3:
+	free_percpu(dnet->latency);
+err2:
+	free_percpu(dnet->stats);
+err1:
+	return err;
+}
+
+static void __net_exit synproxy_dpi_net_exit(struct net *net)
+{
+	struct synproxy_dpi_net *dnet = synproxy_dpi_pernet(net);
+
+	synproxy_dpi_proc_exit(net);
+	synproxy_rtx_flush(net);
+	synproxy_stash_flush(net, NULL);
+	del_timer_sync(&dnet->inprog.timer);
+	synproxy_inprog_reap(net, true);
+	synproxy_trusted_flush(net);
+	synproxy_verdict_flush(dnet);
+	synproxy_route_flush(dnet);
+	free_percpu(dnet->routes);
+	free_percpu(dnet->latency);
+	free_percpu(dnet->stats);
+}
+
+static struct pernet_operations synproxy_dpi_net_ops = {
+	.init		= synproxy_dpi_net_init,
+	.exit		= synproxy_dpi_net_exit,
+	.id		= &synproxy_dpi_net_id,
+	.size		= sizeof(struct synproxy_dpi_net),
+};
 
 static int __init synproxy_tg4_init(void)
 {
 	int err;
 
-	err = nf_register_hooks(ipv4_synproxy_ops,
-				ARRAY_SIZE(ipv4_synproxy_ops));
+	synproxy_stash_init();
+	synproxy_rtx_init();
+	get_random_bytes(&synproxy_verdict_seed, sizeof(synproxy_verdict_seed));
+	get_random_bytes(&synproxy_inprog_seed, sizeof(synproxy_inprog_seed));
+	get_random_bytes(&synproxy_route_seed, sizeof(synproxy_route_seed));
+
+	err = register_pernet_subsys(&synproxy_dpi_net_ops);
+	if (err < 0)
+		goto err0;
+
+	err = register_netdevice_notifier(&synproxy_route_netdev_notifier);
 	if (err < 0)
 		goto err1;
 
-	err = xt_register_target(&synproxy_tg4_reg);
+	err = synproxy_fastpath_init();
 	if (err < 0)
 		goto err2;
 
-	err = xt_register_match(&spstate_mt_reg);
+	err = nf_register_hooks(ipv4_synproxy_ops,
+				ARRAY_SIZE(ipv4_synproxy_ops));
 	if (err < 0)
 		goto err3;
 
+	err = xt_register_target(&synproxy_tg4_reg);
+	if (err < 0)
+		goto err4;
+
+	err = xt_register_matches(spstate_mt_reg, ARRAY_SIZE(spstate_mt_reg));
+	if (err < 0)
+		goto err5;
+
+	err = genl_register_family_with_ops(&synproxy_dpi_genl_family,
+					    synproxy_dpi_genl_ops);
+	if (err < 0)
+		goto err6;
+
 	return 0;
 
-err3:
+err6:
+	xt_unregister_matches(spstate_mt_reg, ARRAY_SIZE(spstate_mt_reg));
+err5:
 	xt_unregister_target(&synproxy_tg4_reg);
-err2:
+err4:
 	nf_unregister_hooks(ipv4_synproxy_ops, ARRAY_SIZE(ipv4_synproxy_ops));
+err3:
+	synproxy_fastpath_fini();
+err2:
+	unregister_netdevice_notifier(&synproxy_route_netdev_notifier);
 err1:
+	unregister_pernet_subsys(&synproxy_dpi_net_ops);
+err0:
 	return err;
 }
 
 static void __exit synproxy_tg4_exit(void)
 {
-	xt_unregister_match(&spstate_mt_reg);
+	genl_unregister_family(&synproxy_dpi_genl_family);
+	xt_unregister_matches(spstate_mt_reg, ARRAY_SIZE(spstate_mt_reg));
 	xt_unregister_target(&synproxy_tg4_reg);
 	nf_unregister_hooks(ipv4_synproxy_ops, ARRAY_SIZE(ipv4_synproxy_ops));
+	synproxy_stash_flush(NULL, NULL);
+	del_timer_sync(&synproxy_stash_timer);
+	synproxy_fastpath_fini();
+	unregister_netdevice_notifier(&synproxy_route_netdev_notifier);
+	unregister_pernet_subsys(&synproxy_dpi_net_ops);
+	del_timer_sync(&synproxy_rtx_wheel.timer);
+	synproxy_rtx_flush(NULL);
+	rcu_barrier();
 }
 
 module_init(synproxy_tg4_init);
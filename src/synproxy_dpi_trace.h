@@ -0,0 +1,206 @@
+/*
+ * Connection lifecycle of the DPI synproxy.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM synproxy_dpi
+
+#if !defined(_SYNPROXY_DPI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SYNPROXY_DPI_TRACE_H
+
+#include <linux/ip.h>
+#include <linux/tcp.h>
+#include <linux/tracepoint.h>
+#include <net/netfilter/nf_conntrack.h>
+
+/* Packets, received or generated, with the addresses as they are on the
+ * wire.
+ */
+DECLARE_EVENT_CLASS(synproxy_dpi_pkt,
+
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th),
+
+	TP_ARGS(iph, th),
+
+	TP_STRUCT__entry(
+		__field(__be32,	saddr)
+		__field(__be32,	daddr)
+		__field(u16,	sport)
+		__field(u16,	dport)
+		__field(u32,	seq)
+		__field(u32,	ack_seq)
+	),
+
+	TP_fast_assign(
+		__entry->saddr		= iph->saddr;
+		__entry->daddr		= iph->daddr;
+		__entry->sport		= ntohs(th->source);
+		__entry->dport		= ntohs(th->dest);
+		__entry->seq		= ntohl(th->seq);
+		__entry->ack_seq	= ntohl(th->ack_seq);
+	),
+
+	TP_printk("%pI4:%u -> %pI4:%u seq=%u ack_seq=%u",
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport,
+		  __entry->seq, __entry->ack_seq)
+);
+
+DEFINE_EVENT(synproxy_dpi_pkt, synproxy_syn_recv,
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th),
+	TP_ARGS(iph, th)
+);
+
+/* seq is the cookie */
+DEFINE_EVENT(synproxy_dpi_pkt, synproxy_synack_send,
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th),
+	TP_ARGS(iph, th)
+);
+
+/* ack_seq relays the ISN of the client handshake */
+DEFINE_EVENT(synproxy_dpi_pkt, synproxy_server_syn_send,
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th),
+	TP_ARGS(iph, th)
+);
+
+DEFINE_EVENT(synproxy_dpi_pkt, synproxy_server_synack_recv,
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th),
+	TP_ARGS(iph, th)
+);
+
+/* Addresses of the original direction, the cookie is computed over them */
+TRACE_EVENT(synproxy_cookie,
+
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th, bool valid),
+
+	TP_ARGS(iph, th, valid),
+
+	TP_STRUCT__entry(
+		__field(__be32,	saddr)
+		__field(__be32,	daddr)
+		__field(u16,	sport)
+		__field(u16,	dport)
+		__field(u32,	seq)
+		__field(u32,	cookie)
+		__field(bool,	valid)
+	),
+
+	TP_fast_assign(
+		__entry->saddr		= iph->saddr;
+		__entry->daddr		= iph->daddr;
+		__entry->sport		= ntohs(th->source);
+		__entry->dport		= ntohs(th->dest);
+		__entry->seq		= ntohl(th->seq);
+		__entry->cookie		= ntohl(th->ack_seq) - 1;
+		__entry->valid		= valid;
+	),
+
+	TP_printk("%pI4:%u -> %pI4:%u seq=%u cookie=%u %s",
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport,
+		  __entry->seq, __entry->cookie,
+		  __entry->valid ? "valid" : "invalid")
+);
+
+/* A segment of a connection in progress dropped by the module */
+TRACE_EVENT(synproxy_in_progress_drop,
+
+	TP_PROTO(const struct iphdr *iph, const struct tcphdr *th,
+		 unsigned int len),
+
+	TP_ARGS(iph, th, len),
+
+	TP_STRUCT__entry(
+		__field(__be32,		saddr)
+		__field(__be32,		daddr)
+		__field(u16,		sport)
+		__field(u16,		dport)
+		__field(u32,		seq)
+		__field(u32,		ack_seq)
+		__field(unsigned int,	len)
+	),
+
+	TP_fast_assign(
+		__entry->saddr		= iph->saddr;
+		__entry->daddr		= iph->daddr;
+		__entry->sport		= ntohs(th->source);
+		__entry->dport		= ntohs(th->dest);
+		__entry->seq		= ntohl(th->seq);
+		__entry->ack_seq	= ntohl(th->ack_seq);
+		__entry->len		= len;
+	),
+
+	TP_printk("%pI4:%u -> %pI4:%u seq=%u ack_seq=%u len=%u",
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport,
+		  __entry->seq, __entry->ack_seq, __entry->len)
+);
+
+/* Connections, identified by the tuple of the original direction */
+DECLARE_EVENT_CLASS(synproxy_dpi_conn,
+
+	TP_PROTO(const struct nf_conn *ct, u32 val),
+
+	TP_ARGS(ct, val),
+
+	TP_STRUCT__entry(
+		__field(const void *,	ct)
+		__field(__be32,		saddr)
+		__field(__be32,		daddr)
+		__field(u16,		sport)
+		__field(u16,		dport)
+		__field(u32,		val)
+	),
+
+	TP_fast_assign(
+		const struct nf_conntrack_tuple *tuple =
+			&ct->tuplehash[IP_CT_DIR_ORIGINAL].tuple;
+
+		__entry->ct		= ct;
+		__entry->saddr		= tuple->src.u3.ip;
+		__entry->daddr		= tuple->dst.u3.ip;
+		__entry->sport		= ntohs(tuple->src.u.tcp.port);
+		__entry->dport		= ntohs(tuple->dst.u.tcp.port);
+		__entry->val		= val;
+	),
+
+	TP_printk("ct=%p %pI4:%u -> %pI4:%u %u", __entry->ct,
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport, __entry->val)
+);
+
+DEFINE_EVENT_PRINT(synproxy_dpi_conn, synproxy_in_progress,
+	TP_PROTO(const struct nf_conn *ct, u32 isn),
+	TP_ARGS(ct, isn),
+	TP_printk("ct=%p %pI4:%u -> %pI4:%u isn=%u", __entry->ct,
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport, __entry->val)
+);
+
+DEFINE_EVENT_PRINT(synproxy_dpi_conn, synproxy_seqadj_init,
+	TP_PROTO(const struct nf_conn *ct, u32 offset),
+	TP_ARGS(ct, offset),
+	TP_printk("ct=%p %pI4:%u -> %pI4:%u offset=%u", __entry->ct,
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport, __entry->val)
+);
+
+DEFINE_EVENT_PRINT(synproxy_dpi_conn, synproxy_finish,
+	TP_PROTO(const struct nf_conn *ct, u32 mark),
+	TP_ARGS(ct, mark),
+	TP_printk("ct=%p %pI4:%u -> %pI4:%u mark=%#x", __entry->ct,
+		  &__entry->saddr, __entry->sport,
+		  &__entry->daddr, __entry->dport, __entry->val)
+);
+
+#endif /* _SYNPROXY_DPI_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE synproxy_dpi_trace
+#include <trace/define_trace.h>